@@ -36,4 +36,14 @@ int main(int argc, char** argv)
 
     // Printed:
     // 24 Hello world 1106.4-printf-style ./ex_basics 0x7fff1f43d618
+
+    // s() converts any value to a string and returns a reference to it
+    Variant v4 = 5;
+    Variant v5 = 2.5;
+    v4.s() += " items";
+
+    printf("%s %s\n", v4.c_str(), v5.s().c_str());
+
+    // Printed:
+    // 5 items 2.5
 }
@@ -0,0 +1,159 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "jvar.h"
+
+using namespace jvar;
+
+/**
+ * \example encodings.cpp
+ * This example shows how to write a variant as MessagePack, CBOR, a snapshot and json
+ * through a JsonWriter, and read each of them back.  It also serializes a large array in
+ * parallel on a WorkerPool.
+ */
+
+Variant makeOrder()
+{
+    Variant order;
+
+    order.createObject();
+    order.addProperty("id", 1001);
+    order.addProperty("customer", "Jane Doe");
+    order.addProperty("paid");
+    order.addProperty("note", VNULL);
+    order.addProperty("items");
+    order["paid"] = true;
+    order["items"].createArray();
+
+    Variant item;
+    item.createObject();
+    item.addProperty("name", "pen");
+    item.addProperty("price", 1.25);
+    order["items"].push(item);
+    item["name"] = "notebook with a long name";
+    item["price"] = 3.5;
+    order["items"].push(item);
+
+    return order;
+}
+
+void showMsgPack(const Variant& order)
+{
+    // MessagePack is a compact binary encoding, numbers and strings are not formatted
+    std::string bin = order.toMsgPack();
+
+    Variant v;
+    if (v.parseMsgPack(bin))
+    {
+        printf("MsgPack %d bytes: %s\n", (int)bin.length(), v.toString().c_str());
+    }
+}
+
+void showCbor(const Variant& order)
+{
+    // CBOR is encoded and decoded the same way
+    std::string bin = order.toCbor();
+
+    Variant v;
+    if (v.parseCbor(bin))
+    {
+        printf("Cbor %d bytes: %s\n", (int)bin.length(), v.toString().c_str());
+    }
+}
+
+void showSnapshot(const Variant& order)
+{
+    // A snapshot is used as it is in memory, without parsing it into a variant
+    if (!order.writeSnapshot("ex_encodings.snap"))
+    {
+        return;
+    }
+
+    Snapshot snap;
+    if (snap.open("ex_encodings.snap"))
+    {
+        const SnapValue& root = snap.root();
+        printf("Snapshot: customer=%s second item=%s\n", root["customer"].c_str(),
+            root.path("items.1.name").c_str());
+
+        double total = 0.0;
+        for (Iter<const SnapValue> i; root["items"].forEach(i); )
+        {
+            total += (*i)["price"].toDouble();
+        }
+        printf("Snapshot: total=%g\n", total);
+
+        // Copy it into a variant to change it
+        Variant v;
+        root.copyTo(v);
+        printf("Snapshot copy: %s\n", v.toString().c_str());
+
+        snap.close();
+    }
+    remove("ex_encodings.snap");
+}
+
+static bool appendOut(void* ctx, const char* data, size_t len)
+{
+    ((std::string*)ctx)->append(data, len);
+    return true;
+}
+
+void showJsonWriter(const Variant& order)
+{
+    // A JsonWriter sends the json to a file, a file descriptor or a callback as its buffer
+    // fills up
+    std::string out;
+    {
+        JsonWriter writer(appendOut, &out);
+        writer.setIndent(Variant::JSON_COMPACT);
+        writer.write(order);
+        writer.flush();
+    }
+
+    Variant v;
+    if (v.parseJson(out.c_str()))
+    {
+        printf("JsonWriter: %s\n", out.c_str());
+        printf("Parsed back: customer=%s\n", v["customer"].c_str());
+    }
+}
+
+void showParallel()
+{
+    Variant arr;
+    arr.createArray();
+    for (int i = 0; i < 100000; i++)
+    {
+        arr.push(i);
+    }
+
+    // Large top level arrays and objects are split into ranges which are serialized on the
+    // pool's threads.  The output is the same as with one thread.
+    WorkerPool pool(4);
+    std::string par = arr.toJsonString(Variant::JSON_COMPACT, &pool);
+    std::string ser = arr.toJsonString(Variant::JSON_COMPACT);
+
+    printf("Parallel: %d chars, same=%s\n", (int)par.length(), par == ser ? "yes" : "no");
+}
+
+int main(int argc, char** argv)
+{
+    Variant order = makeOrder();
+
+    showMsgPack(order);
+    showCbor(order);
+    showSnapshot(order);
+    showJsonWriter(order);
+    showParallel();
+
+    // Printed:
+    // MsgPack 116 bytes: {"id":1001,"customer":"Jane Doe","paid":true,"note":null,"items":[{"name":"pen","price":1.25},{"name":"notebook with a long name","price":3.5}]}
+    // Cbor 109 bytes: {"id":1001,"customer":"Jane Doe","paid":true,"note":null,"items":[{"name":"pen","price":1.25},{"name":"notebook with a long name","price":3.5}]}
+    // Snapshot: customer=Jane Doe second item=notebook with a long name
+    // Snapshot: total=4.75
+    // Snapshot copy: {"id":1001,"customer":"Jane Doe","paid":true,"note":null,"items":[{"name":"pen","price":1.25},{"name":"notebook with a long name","price":3.5}]}
+    // JsonWriter: {"id":1001,"customer":"Jane Doe","paid":true,"note":null,"items":[{"name":"pen","price":1.25},{"name":"notebook with a long name","price":3.5}]}
+    // Parsed back: customer=Jane Doe
+    // Parallel: 588891 chars, same=yes
+}
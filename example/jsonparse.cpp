@@ -40,6 +40,72 @@ void showSimple()
     }
 }
 
+// A handler which adds up all "price" values without building a variant
+
+class PriceTotaler : public JsonHandler
+{
+public:
+    PriceTotaler() :
+        mTotal(0.0),
+        mIsPrice(false)
+    {
+    }
+
+    virtual bool onKey(const char* key, int len)
+    {
+        mIsPrice = equal(key, "price");
+        return true;
+    }
+    virtual bool onValue(const Variant& value)
+    {
+        if (mIsPrice)
+        {
+            mTotal += value.toDouble();
+        }
+        return true;
+    }
+
+    double mTotal;
+    bool mIsPrice;
+};
+
+void showHandler()
+{
+    const char* jsontxt =
+        "["
+        "    {\"name\": \"pen\", \"price\": 1.25},"
+        "    {\"name\": \"paper\", \"price\": 3.50, \"tags\": [\"a4\", \"white\"]}"
+        "]";
+
+    // Parse the json text sending events to the handler
+    PriceTotaler totaler;
+    JsonParser json(totaler, jsontxt);
+    if (!json.failed())
+    {
+        printf("\nTotal price=%g\n", totaler.mTotal);
+    }
+}
+
+void showPush()
+{
+    // Text arriving in pieces, split in the middle of a key and a number
+    const char* chunks[] =
+    {
+        "{\"sen", "sor\": \"t1\", \"readings\": [20.", "5, 21.25]}"
+    };
+
+    Variant v;
+    JsonPushParser json(v);
+    for (size_t i = 0; i < countof(chunks); i++)
+    {
+        json.feed(chunks[i], strlen(chunks[i]));
+    }
+    if (json.finish())
+    {
+        printf("\nPushed json=%s\n", v.toString().c_str());
+    }
+}
+
 #ifdef _MSC_VER
 void testJsonSuite()
 {
@@ -173,6 +239,8 @@ void bench(const char* fn)
 int main(int argc, char** argv)
 {
     showSimple();
+    showHandler();
+    showPush();
     testJsonSuite();
     if (argc > 1)
     {
@@ -0,0 +1,113 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "jvar.h"
+#if __cplusplus > 199711L
+#include <utility>
+#endif
+
+using namespace jvar;
+
+/**
+ * \example memory.cpp
+ * This example shows how jvar keeps copies and strings cheap: short strings stored in the
+ * variant, arrays and objects shared by copies until changed, values moved or popped out
+ * of a JsonDoc, and an ArenaDoc which frees its whole tree at once.
+ */
+
+const char* jsontxt =
+    "{"
+    "    \"user\": \"jdoe\","
+    "    \"tags\": [\"admin\", \"a tag which is too long to be inline\"],"
+    "    \"limits\": {\"cpu\": 4, \"mem\": 8}"
+    "}";
+
+void showStrings()
+{
+    // A variant is 16 bytes.  Strings of up to 11 chars are kept inside of it, longer ones
+    // in a buffer which copies share.
+    Variant shortstr = "hello";
+    Variant longstr = "a string which is too long to be inline";
+    Variant copy = longstr;
+
+    printf("sizeof(Variant)=%d %s / %s\n", (int)sizeof(Variant), shortstr.c_str(), copy.c_str());
+
+    // s() converts any value to a string and returns a reference to it
+    Variant count = 3;
+    Variant price = 9.99;
+    count.s() += " items";
+
+    printf("%s at %s\n", count.c_str(), price.s().c_str());
+}
+
+void showCopyOnWrite()
+{
+    Variant config;
+    config.parseJson(jsontxt);
+
+    // Copies share the arrays and objects until one side changes them
+    config.enableCopyOnWrite();
+
+    Variant req = config;
+    req["limits"]["cpu"] = 2;
+
+    printf("config cpu=%s req cpu=%s\n", config["limits"]["cpu"].toString().c_str(),
+        req["limits"]["cpu"].toString().c_str());
+}
+
+void showMoveOut()
+{
+    JsonDoc doc;
+    if (!doc.parse(jsontxt))
+    {
+        return;
+    }
+
+    // Values taken out of a document own their text, they stay valid after it is cleared
+    Variant last = doc.root()["tags"].pop();
+#if __cplusplus > 199711L
+    Variant limits = std::move(doc.root()["limits"]);
+#else
+    Variant limits = doc.root()["limits"];
+#endif
+    doc.clear();
+
+    printf("popped=%s limits=%s\n", last.c_str(), limits.toString().c_str());
+}
+
+void showArenaDoc()
+{
+    // All of an ArenaDoc's tree comes from a few large blocks which clear() frees at once
+    ArenaDoc doc;
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (doc.parse(jsontxt))
+        {
+            // Values added in a scope of the document's arena are in the arena too
+            Arena::Scope scope(doc.arena());
+            doc.root()["tags"].push("request");
+
+            printf("%d: user=%s tags=%d\n", i, doc.root()["user"].c_str(),
+                doc.root()["tags"].length());
+        }
+        doc.clear();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    showStrings();
+    showCopyOnWrite();
+    showMoveOut();
+    showArenaDoc();
+
+    // Printed:
+    // sizeof(Variant)=16 hello / a string which is too long to be inline
+    // 3 items at 9.99
+    // config cpu=4 req cpu=2
+    // popped=a tag which is too long to be inline limits={"cpu":4,"mem":8}
+    // 0: user=jdoe tags=3
+    // 1: user=jdoe tags=3
+    // 2: user=jdoe tags=3
+}
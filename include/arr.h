@@ -45,6 +45,7 @@ public:
         mMaxLen(0),
         mComp(comp),
         mCountLocal(0),
+        mArena(NULL),
         mFlags(0)
     {
         mCountPtr = &mCountLocal;
@@ -57,7 +58,9 @@ public:
      *
      * @param  src Another array
      */
-    inline BArray(const BArray& src)
+    inline BArray(const BArray& src) :
+        mArena(NULL),
+        mFlags(0)
     {
         copyFrom((BArray&)src, false, false);
     }
@@ -66,7 +69,9 @@ public:
      *
      * @param  src Another array
      */
-    inline BArray(BArray& src)
+    inline BArray(BArray& src) :
+        mArena(NULL),
+        mFlags(0)
     {
         copyFrom(src, false, false);
     }
@@ -98,6 +103,30 @@ public:
      */
     void useFixedMem(void* memptr, int* countptr, int maxlen);
 
+    /**
+     * Takes the memory for the array from an arena.  It's never freed by the array, it is
+     * given back with the arena.  Must be called before anything is added.
+     *
+     * @param arena Arena, or NULL to keep using the heap
+     */
+    inline void useArena(Arena* arena)
+    {
+        if (arena != NULL)
+        {
+            assert(mMaxLen == 0 && isFlagClear(mFlags, FLAG_FIXEDBUF));
+            mArena = arena;
+            setFlag(mFlags, FLAG_ARENA);
+        }
+    }
+
+    /**
+     * Returns the arena of the array, or NULL if it's on the heap
+     */
+    inline Arena* arena() const
+    {
+        return isFlagSet(mFlags, FLAG_ARENA) ? mArena : NULL;
+    }
+
     /**
      * Deletes all elements
      */
@@ -250,6 +279,7 @@ private:
     Compare mComp;
     int mCountLocal;
     Buffer mBuf;
+    Arena* mArena;
 
 public:
     /**
@@ -272,7 +302,12 @@ public:
         /**
          * Internal: Used to indicate case insensitive.  Only used by specific compare functions.
          */
-        FLAG_CASEINS = 0x2
+        FLAG_CASEINS = 0x2,
+
+        /**
+         * Internal: Array memory is from an arena (see useArena)
+         */
+        FLAG_ARENA = 0x4
     };
 
 protected:
@@ -303,6 +338,19 @@ protected:
     {
         *mCountPtr = 0;
     }
+
+public:
+    /**
+     * Shortens the array to \p len elements.  Unlike remove(), the memory is kept for
+     * reuse.
+     */
+    inline void truncate(int len)
+    {
+        if (len >= 0 && len < length())
+        {
+            *mCountPtr = len;
+        }
+    }
 };
 
 
@@ -332,6 +380,15 @@ public:
     {
     }
 
+    /**
+     * Construct a blank ObjArray with its memory from \p arena.
+     */
+    inline ObjArray(Arena& arena) :
+        BArray(sizeof(T), NULL)
+    {
+        useArena(&arena);
+    }
+
     /**
      * Construct an ObjArray and copy the data from \p src into it.
      */
@@ -341,6 +398,17 @@ public:
         copyFrom((ObjArray&)src);
     }
 
+    /**
+     * Construct an ObjArray with its memory from \p arena and copy the data from \p src
+     * into it.
+     */
+    inline ObjArray(const ObjArray& src, Arena& arena) :
+        BArray(sizeof(T), NULL)
+    {
+        useArena(&arena);
+        copyFrom((ObjArray&)src);
+    }
+
     /**
      * Construct an ObjArray and copy the data from \p src into it.
      */
@@ -535,6 +603,20 @@ public:
         mExtInterface.release();
     }
 
+    /**
+     * Deletes the elements from position \p len onwards, keeping the memory for reuse
+     */
+    void truncate(int len)
+    {
+        for (int i = len; i < BArray::length(); i++)
+        {
+            T* obj = (T*)BArray::get(i);
+            obj->~T();
+        }
+
+        BArray::truncate(len);
+    }
+
     /**
      * Finds the item
      *
@@ -697,6 +779,38 @@ public:
         mIndex.reserve(INITSIZE);
     }
 
+    /**
+     * Constructs a PropArray with its memory, including long keys, from \p arena
+     */
+    PropArray(Arena& arena) :
+        mData(arena),
+        mIndex(arena)
+    {
+        mData.reserve(INITSIZE);
+        mIndex.reserve(INITSIZE);
+    }
+
+    /**
+     * Constructs a PropArray with its memory from \p arena as a copy of \p src
+     */
+    PropArray(const PropArray& src, Arena& arena) :
+        mData(arena),
+        mIndex(src.mIndex, arena)
+    {
+        PropArray& from = const_cast<PropArray&>(src);
+
+        mData.reserve(from.mData.length());
+        for (int i = 0; i < from.mData.length(); i++)
+        {
+            DataElem* srcdat = from.mData.get(i);
+            DataElem* dat = mData.append();
+
+            setKey(dat, srcdat->key.get());
+            dat->value = srcdat->value;
+        }
+        mData.extInterface() = from.mData.extInterface();
+    }
+
     ~PropArray()
     {
     }
@@ -739,7 +853,7 @@ public:
 
         // Set the key in the data object.
 
-        dat->key.set(keyname);
+        setKey(dat, keyname);
 
         // Now, add the key to the index at the position determined by binary search earlier.
 
@@ -953,6 +1067,43 @@ public:
         mIndex.clear();
     }
 
+    /**
+     * Makes room for \p count properties
+     */
+    inline void reserve(int count)
+    {
+        mData.reserve(count);
+        mIndex.reserve(count);
+    }
+
+    /**
+     * Removes the properties from position \p len onwards, keeping the memory for reuse
+     *
+     * @param  len Number of properties to keep
+     */
+    void truncate(int len)
+    {
+        if (len < 0 || len >= mData.length())
+        {
+            return;
+        }
+
+        // Keep the index entries of the remaining properties, in order.
+
+        int kept = 0;
+        for (int i = 0; i < mIndex.length(); i++)
+        {
+            int loc = *mIndex.get(i);
+            if (loc < len)
+            {
+                *mIndex.get(kept++) = loc;
+            }
+        }
+        mIndex.truncate(kept);
+
+        mData.truncate(len);
+    }
+
     /**
      * Makes the property array case-insensitive
      */
@@ -961,8 +1112,24 @@ public:
         setFlag(mIndex.mFlags, BArray::FLAG_CASEINS);
     }
 
+    /**
+     * Returns true if the property array is case-insensitive
+     */
+    inline bool isCI()
+    {
+        return isFlagSet(mIndex.mFlags, BArray::FLAG_CASEINS);
+    }
+
 /** \cond Internal */
 
+    /**
+     * Returns the position of the property which is at \p i in sorted order
+     */
+    inline int indexPos(int i)
+    {
+        return *mIndex.get(i);
+    }
+
     inline jvar::RcLife<jvar::BaseInterface>& extInterface()
     {
         return mData.extInterface();
@@ -1063,6 +1230,28 @@ private:
         return false;
     }
 
+    inline void setKey(DataElem* dat, const char* keyname)
+    {
+        // Keys too long for the FixedStr are copied into the arena of an arena array
+
+        Arena* arena = mData.arena();
+        if (arena != NULL)
+        {
+            size_t len = strlen(keyname);
+            if (len > FIXEDSTRSIZE - 2)
+            {
+                char* key = (char*)arena->alloc(len + 1);
+                if (key != NULL)
+                {
+                    memcpy(key, keyname, len + 1);
+                    dat->key.setExt(key);
+                    return;
+                }
+            }
+        }
+        dat->key.set(keyname);
+    }
+
     inline DataElem* indexGet(int pos)
     {
         int* index = mIndex.get(pos);
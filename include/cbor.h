@@ -0,0 +1,87 @@
+/**
+ * @file include/cbor.h
+ * Declares the Cbor class.
+ * @copyright Copyright (c) 2014 Yasser Asmi; Released under the MIT
+ *            License (http://opensource.org/licenses/MIT)
+ */
+
+#ifndef _CBOR_H
+#define _CBOR_H
+
+#include "str.h"
+#include "var.h"
+#include <stdint.h>
+
+namespace jvar
+{
+
+/**
+ * Cbor converts Variants to and from CBOR (RFC 8949), a binary alternative to json:
+ * \code
+ *    StrBld encoded;
+ *    Cbor::encode(v, encoded);
+ *
+ *    Variant v2;
+ *    if (Cbor::decode(v2, encoded.c_str(), encoded.length()))
+ *    {
+ *        ...
+ *    }
+ * \endcode
+ * Arrays and maps are encoded with definite lengths taken from Variant::length(), and the
+ * decoder reserves the containers from the lengths before filling them.  Doubles are
+ * encoded as 32-bit floats when that is exact, otherwise as 64-bit.  Null, empty and
+ * function Variants are encoded as null.
+ *
+ * On decoding, indefinite length items, half floats and tags (which are ignored) are
+ * accepted too.  Values a Variant can't hold as they are get converted without an
+ * error:
+ *  - Ints out of longint's range become the nearest double.  A double has 53 bits of
+ *    mantissa, so most of them lose their low bits and don't come back exactly if they
+ *    are encoded again.
+ *  - Byte strings become strings and undefined becomes null.
+ *  - Map keys which aren't strings are converted with Variant::toString(), so 1 and "1"
+ *    are the same key.  Keys which are arrays or maps fail the decode.
+ *  - A key which appears more than once in a map keeps the last value.
+ */
+class Cbor
+{
+public:
+    enum
+    {
+        /**
+         * Maximum nesting of arrays, maps and tags accepted by decode()
+         */
+        MAXDEPTH = 512
+    };
+
+    /**
+     * Encodes a Variant
+     *
+     * @param  var Variant to encode
+     * @param  out Receives the encoded bytes (appended)
+     */
+    static void encode(const Variant& var, StrBld& out);
+
+    /**
+     * Decodes one data item into a Variant
+     *
+     * @param  var  Variant to decode into
+     * @param  data Encoded bytes
+     * @param  len  Number of bytes
+     * @param  used Optional, receives the number of bytes used by the item, otherwise
+     *              all of the bytes must be used
+     *
+     * @return      Success
+     */
+    static bool decode(Variant& var, const char* data, size_t len, size_t* used = NULL);
+
+private:
+    static void encodeValue(Variant& var, StrBld& out);
+    static const uchar* decodeValue(Variant& var, const uchar* p, const uchar* end, int depth);
+    static const uchar* decodeStr(Variant& var, uchar major, uint64_t len, bool indefinite,
+        const uchar* p, const uchar* end);
+};
+
+} // jvar
+
+#endif // _CBOR_H
@@ -10,10 +10,37 @@
 
 #include "str.h"
 #include "var.h"
+#include <stdint.h>
 
 namespace jvar
 {
 
+/**
+ * JsonHandler receives parsing events from JsonParser instead of a Variant tree being
+ * built.  Scalar values are delivered through a single scratch Variant owned by the
+ * parser so no per-node allocations are made.  Any callback may return false to stop
+ * parsing (the parser then reports failure).
+ */
+class JsonHandler
+{
+public:
+    virtual ~JsonHandler()
+    {
+    }
+
+    virtual bool onStartObject();
+    virtual bool onKey(const char* key, int len);
+    virtual bool onEndObject();
+    virtual bool onStartArray();
+    virtual bool onEndArray();
+
+    /**
+     * Called for strings, numbers, true, false and null.  The value is only valid
+     * for the duration of the call.
+     */
+    virtual bool onValue(const Variant& value);
+};
+
 /**
  * JsonParser class parses a json string into a Variant structure.
  */
@@ -29,6 +56,27 @@ public:
      */
     JsonParser(Variant& outvar, const char* jsontxt, uint flags = 0);
 
+    /**
+     * Constructor which parses without building a Variant, sending events to a handler
+     *
+     * @param  handler Handler to receive the events
+     * @param  jsontxt Json text to parse
+     * @param  flags   Flags
+     */
+    JsonParser(JsonHandler& handler, const char* jsontxt, uint flags = 0);
+
+    /**
+     * Constructors for text that is not null terminated, such as a memory mapped file.
+     * The text must be writable if FLAG_INSITU is used.
+     *
+     * @param  outvar  Variant which will contain the parsed data structure
+     * @param  jsontxt Json text to parse
+     * @param  len     Length of the text
+     * @param  flags   Flags
+     */
+    JsonParser(Variant& outvar, const char* jsontxt, size_t len, uint flags);
+    JsonParser(JsonHandler& handler, const char* jsontxt, size_t len, uint flags);
+
     /**
      * Flags that can be set in \ref mFlags.
      */
@@ -45,10 +93,42 @@ public:
         /**
          * Start with parsing an array
          */
-        FLAG_ARRAYONLY = 0x4
+        FLAG_ARRAYONLY = 0x4,
+        /**
+         * Parse in-situ: the json text is modified in place and string values in the
+         * Variant point into it, so the text must outlive the Variant (see JsonDoc)
+         */
+        FLAG_INSITU = 0x8,
+        /**
+         * Parse lazily: objects and arrays below the top level only record where their
+         * text is and are parsed when first used.  Untouched values are just skipped
+         * over.  Requires FLAG_INSITU on null terminated text (see JsonDoc).
+         */
+        FLAG_LAZY = 0x10,
+        /**
+         * Parse into the existing data of the Variant, reusing its objects, arrays and
+         * strings where the new document has the same shape (see Variant::reparseJson)
+         */
+        FLAG_REUSE = 0x20
     };
 
+    /**
+     * Parses an object or array recorded with FLAG_LAZY into \p var
+     *
+     * @param  var   Variant to parse into
+     * @param  txt   Json text of the object or array
+     * @param  flags Flags
+     *
+     * @return       Success
+     */
+    static bool parseLazy(Variant& var, const char* txt, uint flags);
+
 protected:
+    /**
+     * Parse the top level object or array into \p var.
+     */
+    void parseDoc(Variant& var);
+
     /**
      * Parse an object into \p var.
      */
@@ -74,6 +154,17 @@ protected:
      */
     void parseValue(Variant& var);
 
+    /**
+     * With FLAG_REUSE, returns the property of \p var at position \p n if it has the key
+     * \p keyname, otherwise drops the properties from \p n on and adds the key.
+     */
+    Variant& reuseProperty(Variant& var, int& n, const char* keyname);
+
+    /**
+     * Skip over an object or array, recording it as a lazy value in \p var.
+     */
+    void skipLazy(Variant& var);
+
     /**
      * Parse a number into \p var.
      */
@@ -118,11 +209,713 @@ protected:
         return (c >='0' && c <= '9');
     }
 
+    /**
+     * Report the result of a handler callback; stops parsing if the handler declined.
+     */
+    inline void handled(bool ok)
+    {
+        if (!ok)
+        {
+            setError("Stopped by handler");
+        }
+    }
+
 protected:
     /**
      * Flags that are set on this object.
      */
     uint mFlags;
+
+    /**
+     * Handler receiving events or NULL when building a Variant.
+     */
+    JsonHandler* mHandler;
+
+    /**
+     * Copy of the current property key when it can't be referenced in place.  Kept
+     * across objects so its memory is reused.
+     */
+    StrBld mKey;
+
+    /**
+     * Scratch value passed to the handler.
+     */
+    Variant mValue;
+};
+
+/**
+ * JsonDoc owns a json text buffer along with the Variant parsed from it.  The text is
+ * parsed in-situ so string values in the Variant reference the text in the buffer
+ * instead of holding copies.  Copying a value out of the document, or calling s() on
+ * it, gives it a string of its own.
+ *
+ * With JsonParser::FLAG_LAZY, nested objects and arrays are only parsed when they are
+ * first used, which is much faster when only a few values are read from a large text.
+ * Errors inside a nested value are then found when it's used (it becomes empty) rather
+ * than by parse().  A lazy document should not be read from multiple threads at once.
+ */
+class JsonDoc
+{
+public:
+    /**
+     * Constructor
+     *
+     * @param  flags JsonParser flags used in addition to FLAG_INSITU, such as FLAG_LAZY
+     */
+    JsonDoc(uint flags = 0) :
+        mFlags(flags)
+    {
+    }
+
+    /**
+     * Copies the json text into the document and parses it
+     *
+     * @param  jsontxt Json text
+     *
+     * @return         Success
+     */
+    bool parse(const char* jsontxt);
+
+    /**
+     * Reads a json file into the document and parses it
+     *
+     * @param  filename Name of the file
+     *
+     * @return          Success
+     */
+    bool readFile(const char* filename);
+
+    /**
+     * Returns the root of the document
+     */
+    inline Variant& root()
+    {
+        return mRoot;
+    }
+
+    /**
+     * Clears the document
+     */
+    void clear();
+
+private:
+    JsonDoc(const JsonDoc&);
+    JsonDoc& operator=(const JsonDoc&);
+
+    bool parseTxt();
+
+private:
+    uint mFlags;
+    Buffer mTxt;
+    Variant mRoot;
+};
+
+/**
+ * ArenaDoc is a document whose Variant tree is allocated from an Arena.  Objects, arrays,
+ * their element memory, long keys and the json text all come from a few large blocks,
+ * and string values reference the text as in JsonDoc.  Clearing the document gives the
+ * blocks back without going over the tree:
+ * \code
+ *    ArenaDoc doc;
+ *    if (doc.parse(request))
+ *    {
+ *        const char* user = doc.root()["user"].c_str();
+ *        ...
+ *    }
+ *    doc.clear();
+ * \endcode
+ * The tree can be changed like any other Variant.  Values made for it are allocated
+ * normally, and the arrays and objects changed after the parse are marked so clear() frees
+ * the heap values in them without going over the rest of the tree.  To take the new
+ * values from the arena too, change the tree while an Arena::Scope of the document's arena
+ * is active (see its note about other Variants made meanwhile).  Values copied or moved
+ * out of the document get memory of their own.
+ *
+ * JsonParser::FLAG_LAZY is ignored, nested values would be parsed outside of the arena.
+ */
+class ArenaDoc
+{
+public:
+    /**
+     * Constructor
+     *
+     * @param  flags     JsonParser flags used in addition to FLAG_INSITU
+     * @param  blocksize Size of the arena blocks
+     */
+    ArenaDoc(uint flags = 0, size_t blocksize = Arena::BLOCKSIZE) :
+        mFlags(flags & ~JsonParser::FLAG_LAZY),
+        mArena(blocksize)
+    {
+    }
+
+    ~ArenaDoc()
+    {
+        clear();
+    }
+
+    /**
+     * Copies the json text into the arena and parses it
+     *
+     * @param  jsontxt Json text
+     *
+     * @return         Success
+     */
+    bool parse(const char* jsontxt);
+
+    /**
+     * Reads a json file into the arena and parses it
+     *
+     * @param  filename Name of the file
+     *
+     * @return          Success
+     */
+    bool readFile(const char* filename);
+
+    /**
+     * Returns the root of the document
+     */
+    inline Variant& root()
+    {
+        return mRoot;
+    }
+
+    /**
+     * Returns the arena of the document, for an Arena::Scope
+     */
+    inline Arena& arena()
+    {
+        return mArena;
+    }
+
+    /**
+     * Clears the document and frees the arena
+     */
+    void clear();
+
+private:
+    ArenaDoc(const ArenaDoc&);
+    ArenaDoc& operator=(const ArenaDoc&);
+
+    bool parseTxt(const char* jsontxt, size_t len);
+
+private:
+    uint mFlags;
+    Arena mArena;
+    Variant mRoot;
+};
+
+/**
+ * JsonBuilder is a JsonHandler which builds a Variant from the events it receives.
+ */
+class JsonBuilder : public JsonHandler
+{
+public:
+    /**
+     * Constructor
+     *
+     * @param  outvar Variant which will contain the built data structure
+     */
+    JsonBuilder(Variant& outvar);
+
+    /**
+     * Starts over so the next value received becomes the root again
+     */
+    void reset();
+
+    virtual bool onStartObject();
+    virtual bool onKey(const char* key, int len);
+    virtual bool onEndObject();
+    virtual bool onStartArray();
+    virtual bool onEndArray();
+    virtual bool onValue(const Variant& value);
+
+private:
+    Variant* place();
+
+private:
+    Variant& mRoot;
+
+    /**
+     * Open objects and arrays (Variant*).  The pointers stay valid because a container
+     * doesn't grow while one of its children is open.
+     */
+    BArray mStack;
+    std::string mKey;
+};
+
+/**
+ * JsonPushParser parses json text that arrives in chunks, such as from a socket or a
+ * pipe.  Chunks can be split anywhere, including in the middle of a string or a number.
+ * All state is kept between calls to feed() and the result is complete once finish()
+ * is called after the last chunk:
+ * \code
+ *    Variant v;
+ *    JsonPushParser json(v);
+ *    while ((n = read(fd, buf, sizeof(buf))) > 0)
+ *    {
+ *        if (!json.feed(buf, n))
+ *        {
+ *            break;
+ *        }
+ *    }
+ *    if (json.finish())
+ *    {
+ *        // use v
+ *    }
+ * \endcode
+ * The top level value must be an object or an array.  Unlike JsonParser, only standard
+ * json is accepted (keys must be in double quotes).
+ */
+class JsonPushParser
+{
+public:
+    /**
+     * Constructor
+     *
+     * @param  outvar Variant which will contain the parsed data structure
+     */
+    JsonPushParser(Variant& outvar);
+
+    /**
+     * Constructor which sends events to a handler instead of building a Variant
+     *
+     * @param  handler Handler to receive the events
+     */
+    JsonPushParser(JsonHandler& handler);
+
+    /**
+     * Parses the next chunk of text
+     *
+     * @param  data Text
+     * @param  len  Length of the text
+     *
+     * @return      False on a parsing error
+     */
+    bool feed(const char* data, size_t len);
+
+    /**
+     * Ends the input.  Fails if the document is incomplete.
+     *
+     * @return Success
+     */
+    bool finish();
+
+    /**
+     * Resets the parser so a new document can be parsed
+     */
+    void reset();
+
+    /**
+     * Was there a failure
+     */
+    inline bool failed()
+    {
+        return mErr;
+    }
+
+    /**
+     * Returns the error message
+     */
+    inline std::string& errMsg()
+    {
+        return mErrMsg;
+    }
+
+private:
+    JsonPushParser(const JsonPushParser&);
+    JsonPushParser& operator=(const JsonPushParser&);
+
+    enum LexEnum
+    {
+        LEX_NONE, LEX_STRING, LEX_WORD
+    };
+
+    enum ExpectEnum
+    {
+        EXP_VALUE, EXP_KEY, EXP_COLON, EXP_NEXT, EXP_DONE
+    };
+
+    const char* lexString(const char* p, const char* end);
+    bool endWord();
+    void flushSurrogate();
+    bool structural(char c);
+    void afterValue();
+    bool handled(bool ok);
+    void setError(const char* msg);
+
+private:
+    Variant mValue;
+    JsonBuilder mBuilder;
+    JsonHandler* mHandler;
+    Variant* mOutVar;
+
+    LexEnum mLex;
+    ExpectEnum mExpect;
+
+    /**
+     * Nesting of open objects and arrays ('{' and '[')
+     */
+    StrBld mNest;
+
+    /**
+     * Text of the string, number or literal being read
+     */
+    StrBld mTok;
+    bool mIsKey;
+    bool mEmpty;
+    bool mEscape;
+    int mHexLeft;
+    uint mHex;
+    uint mHighSurrogate;
+
+    int mLineNum;
+    bool mErr;
+    std::string mErrMsg;
+};
+
+/**
+ * JsonWriter writes Variants as json into a bounded buffer which is flushed to a file
+ * descriptor, a FILE* or a callback as it fills up, so a large document is never held in
+ * memory as a whole:
+ * \code
+ *    JsonWriter writer(fileno(stdout));
+ *    writer.write(v);
+ *    if (!writer.flush())
+ *    {
+ *        // write error
+ *    }
+ * \endcode
+ */
+class JsonWriter
+{
+public:
+    /**
+     * Callback receiving the output.  Returns false to fail the writer.
+     */
+    typedef bool (*WriteFunc)(void* ctx, const char* data, size_t len);
+
+    enum
+    {
+        DEFAULT_BUFSIZE = 64 * 1024
+    };
+
+    /**
+     * Writes to a file descriptor
+     */
+    JsonWriter(int fd, size_t bufsize = DEFAULT_BUFSIZE);
+
+    /**
+     * Writes to a stdio file
+     */
+    JsonWriter(FILE* fp, size_t bufsize = DEFAULT_BUFSIZE);
+
+    /**
+     * Writes to a callback
+     */
+    JsonWriter(WriteFunc func, void* ctx, size_t bufsize = DEFAULT_BUFSIZE);
+
+    /**
+     * Destructor, flushes what is left in the buffer
+     */
+    ~JsonWriter();
+
+    /**
+     * Writes a Variant as json
+     *
+     * @param  var Variant to write
+     *
+     * @return     False if writing to the sink has failed
+     */
+    bool write(const Variant& var);
+
+    /**
+     * Writes text as is, such as a separator between documents
+     *
+     * @param  txt Text
+     * @param  len Length of the text
+     *
+     * @return     False if writing to the sink has failed
+     */
+    bool writeRaw(const char* txt, size_t len);
+
+    /**
+     * Sets the indentation for the values written next
+     *
+     * @param indent Variant::JSON_TABS (default), Variant::JSON_COMPACT or number of
+     *               spaces to indent with
+     */
+    inline void setIndent(int indent)
+    {
+        mIndent = indent;
+    }
+
+    /**
+     * Serializes large top level arrays and objects in parallel on a pool's threads.  The
+     * ranges of elements are written in order with writev() when writing to a file
+     * descriptor.
+     *
+     * @param pool WorkerPool to use, or NULL for the calling thread only (default)
+     */
+    inline void setPool(WorkerPool* pool)
+    {
+        mPool = pool;
+    }
+
+    /**
+     * Sends everything buffered to the sink
+     *
+     * @return False if writing to the sink has failed
+     */
+    bool flush();
+
+    inline bool failed()
+    {
+        return mFailed;
+    }
+
+/** \cond INTERNAL */
+    /**
+     * Called by the serializer between values to flush a full buffer
+     */
+    inline void checkFlush()
+    {
+        if (mBuf.length() >= mBufSize)
+        {
+            (void)flush();
+        }
+    }
+
+    /**
+     * Called by the parallel serializer to write the buffered output followed by the
+     * output of each range, in order
+     */
+    bool writeChunks(StrBld* bufs, int count);
+/** \endcond */
+
+private:
+    JsonWriter(const JsonWriter&);
+    JsonWriter& operator=(const JsonWriter&);
+
+    bool sinkWrite(const char* data, size_t len);
+
+private:
+    int mFd;
+    FILE* mFp;
+    WriteFunc mFunc;
+    void* mCtx;
+    int mIndent;
+    WorkerPool* mPool;
+    size_t mBufSize;
+
+    /**
+     * Sized a bit over mBufSize since a value written between checks can go over it
+     */
+    StrBld mBuf;
+    bool mFailed;
+};
+
+/**
+ * JsonExtractor gets the values at a few paths out of json text without building a
+ * Variant for the whole document.  Everything not on one of the paths is skipped over
+ * by looking at quotes and brackets only.  The paths are set once and can be used for
+ * many texts:
+ * \code
+ *    JsonExtractor ex;
+ *    ex.addPath("user.address.city");
+ *    ex.addPath("items.3.price");
+ *
+ *    Variant vals;
+ *    if (ex.extract(jsontxt, vals))
+ *    {
+ *        // vals[0] is the city, vals[1] the price
+ *    }
+ * \endcode
+ * Paths use the Variant::path() syntax.  If a key appears more than once, the first one
+ * is used.  Skipped values are only checked for balanced quotes and brackets, and the
+ * scan stops as soon as all the paths are found.
+ */
+class JsonExtractor
+{
+public:
+    enum
+    {
+        MAXPATHS = 64
+    };
+
+    JsonExtractor();
+
+    /**
+     * Adds a path to extract
+     *
+     * @param  path Property names and array indexes separated by '.'
+     *
+     * @return      Index of the path's value in the result, or -1 if there are already
+     *              MAXPATHS paths
+     */
+    int addPath(const char* path);
+
+    /**
+     * Removes all the paths
+     */
+    void clearPaths();
+
+    /**
+     * Extracts the values at the paths from json text
+     *
+     * @param  jsontxt Json text
+     * @param  len     Length of the text
+     * @param  values  Receives an array with the value of each path in the order they
+     *                 were added.  The value is null if the path is not found.
+     *
+     * @return         False if the text scanned is not valid json
+     */
+    bool extract(const char* jsontxt, size_t len, Variant& values);
+    inline bool extract(const char* jsontxt, Variant& values)
+    {
+        return extract(jsontxt, strlen(jsontxt), values);
+    }
+
+private:
+    struct PathInfo
+    {
+        int first;
+        int count;
+    };
+
+    const char* scan(const char* p, int depth, uint64_t active);
+    const char* scanObject(const char* p, int depth, uint64_t active);
+    const char* scanArray(const char* p, int depth, uint64_t active);
+    void setFound(int n, Variant& value, int depth);
+
+    inline PathInfo* pathInfo(int n)
+    {
+        return (PathInfo*)mPaths.get(n);
+    }
+
+private:
+    /**
+     * Segments of all the paths, with the array index for each or -1
+     */
+    StrArray mSegs;
+    BArray mSegIndex;
+    BArray mPaths;
+
+    const char* mEnd;
+    Variant* mValues;
+    uint64_t mMissing;
+};
+
+/**
+ * NdjsonReader reads newline delimited json (one object or array per line), such as
+ * logs.  Records are parsed in batches on a WorkerPool and returned in order by next():
+ * \code
+ *    NdjsonReader reader;
+ *    reader.readFile("events.ndjson");
+ *    Variant rec;
+ *    while (reader.next(rec))
+ *    {
+ *        // use rec
+ *    }
+ * \endcode
+ * or passed to a callback in no particular order with forEach().  Blank lines are skipped
+ * and lines that fail to parse are counted in errorCount().
+ */
+class NdjsonReader
+{
+public:
+    /**
+     * Callback for forEach().  It is called from multiple threads at the same time.
+     * Return false to stop.
+     */
+    typedef bool (*RecordFunc)(Variant& rec, void* ctx);
+
+    /**
+     * Constructor
+     *
+     * @param  numthreads Number of threads to parse with, 0 uses one per processor
+     */
+    NdjsonReader(int numthreads = 0);
+
+    /**
+     * Maps a file to read records from
+     *
+     * @param  filename Name of the file
+     *
+     * @return          Success
+     */
+    bool readFile(const char* filename);
+
+    /**
+     * Sets the text to read records from.  The text must stay valid while reading.
+     *
+     * @param txt Text
+     * @param len Length of the text
+     */
+    void setText(const char* txt, size_t len);
+
+    /**
+     * Returns the next record in order
+     *
+     * @param  rec Receives the record, which is moved out of the reader
+     *
+     * @return     False when there are no more records
+     */
+    bool next(Variant& rec);
+
+    /**
+     * Parses the remaining records and passes each to \p func, in no particular order
+     *
+     * @param  func Callback
+     * @param  ctx  Context passed to the callback
+     *
+     * @return      False if the callback stopped
+     */
+    bool forEach(RecordFunc func, void* ctx);
+
+    /**
+     * Returns the number of lines that failed to parse so far
+     */
+    inline size_t errorCount()
+    {
+        return mErrors;
+    }
+
+private:
+    NdjsonReader(const NdjsonReader&);
+    NdjsonReader& operator=(const NdjsonReader&);
+
+    struct Line
+    {
+        const char* txt;
+        size_t len;
+    };
+
+    int splitLines();
+    static bool parseLine(const Line& line, Variant& rec);
+    static void parseTask(void* ctx, int index);
+    static void forEachTask(void* ctx, int index);
+
+private:
+    WorkerPool mPool;
+    MappedFile mFile;
+
+    const char* mTxt;
+    size_t mLen;
+    size_t mPos;
+    size_t mErrors;
+
+    /**
+     * Lines of the current batch and the records parsed from them
+     */
+    BArray mLines;
+    ObjArray<Variant> mRecs;
+    int mNextRec;
+    int mTaskLines;
+
+    RecordFunc mFunc;
+    void* mFuncCtx;
+    Buffer mTaskErrors;
+    volatile int mStop;
 };
 
 } // jvar
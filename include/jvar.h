@@ -13,5 +13,8 @@
 #include "var.h"
 #include "arr.h"
 #include "json.h"
+#include "msgpack.h"
+#include "cbor.h"
+#include "snapshot.h"
 
 #endif // _JVAR_H
\ No newline at end of file
@@ -0,0 +1,85 @@
+/**
+ * @file include/msgpack.h
+ * Declares the MsgPack class.
+ * @copyright Copyright (c) 2014 Yasser Asmi; Released under the MIT
+ *            License (http://opensource.org/licenses/MIT)
+ */
+
+#ifndef _MSGPACK_H
+#define _MSGPACK_H
+
+#include "str.h"
+#include "var.h"
+
+namespace jvar
+{
+
+/**
+ * MsgPack converts Variants to and from MessagePack (https://msgpack.org), a binary
+ * alternative to json.  Numbers are stored in binary and strings as length and bytes, so
+ * there is no formatting, number parsing or escaping:
+ * \code
+ *    StrBld packed;
+ *    MsgPack::encode(v, packed);
+ *
+ *    Variant v2;
+ *    if (MsgPack::decode(v2, packed.c_str(), packed.length()))
+ *    {
+ *        ...
+ *    }
+ * \endcode
+ * Ints use the smallest encoding that fits and doubles are always 64-bit so they come
+ * back exactly.  Null, empty and function Variants are encoded as nil.  Extension types
+ * are not supported.
+ *
+ * On decoding, values a Variant can't hold as they are get converted without an error:
+ *  - Unsigned ints over LONG_MAX become the nearest double.  A double has 53 bits of
+ *    mantissa, so most of them lose their low bits and don't come back exactly if they
+ *    are encoded again.
+ *  - Binary values become strings.
+ *  - Map keys which aren't strings are converted with Variant::toString(), so 1 and "1"
+ *    are the same key.  Keys which are arrays or maps fail the decode.
+ *  - A key which appears more than once in a map keeps the last value.
+ */
+class MsgPack
+{
+public:
+    enum
+    {
+        /**
+         * Maximum nesting of arrays and maps accepted by decode()
+         */
+        MAXDEPTH = 512
+    };
+
+    /**
+     * Encodes a Variant
+     *
+     * @param  var Variant to encode
+     * @param  out Receives the encoded bytes (appended)
+     */
+    static void encode(const Variant& var, StrBld& out);
+
+    /**
+     * Decodes one value into a Variant
+     *
+     * @param  var  Variant to decode into
+     * @param  data Encoded bytes
+     * @param  len  Number of bytes
+     * @param  used Optional, receives the number of bytes used by the value, otherwise
+     *              all of the bytes must be used
+     *
+     * @return      Success
+     */
+    static bool decode(Variant& var, const char* data, size_t len, size_t* used = NULL);
+
+private:
+    static void encodeValue(Variant& var, StrBld& out);
+    static void encodeStr(const char* s, size_t len, StrBld& out);
+    static void encodeInt(longint n, StrBld& out);
+    static const uchar* decodeValue(Variant& var, const uchar* p, const uchar* end, int depth);
+};
+
+} // jvar
+
+#endif // _MSGPACK_H
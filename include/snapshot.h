@@ -0,0 +1,284 @@
+/**
+ * @file include/snapshot.h
+ * Declares the Snapshot and SnapValue classes.
+ * @copyright Copyright (c) 2014 Yasser Asmi; Released under the MIT
+ *            License (http://opensource.org/licenses/MIT)
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "util.h"
+#include "var.h"
+#include <stdint.h>
+
+namespace jvar
+{
+
+/**
+ * SnapValue is a read-only value inside a Snapshot.  It is a 16 byte record in the
+ * snapshot's memory, and strings, elements and properties are found through offsets
+ * relative to the record itself, so values are used in place without being copied or
+ * converted.  SnapValues are only handled by reference:
+ * \code
+ *    const SnapValue& city = snap.root().path("user.address.city");
+ *    printf("%s\n", city.c_str());
+ *
+ *    for (Iter<const SnapValue> i; snap.root()["items"].forEach(i); )
+ *    {
+ *        total += (*i)["price"].toDouble();
+ *    }
+ * \endcode
+ * Lookups of missing keys or indexes return a null value.  The references stay valid for
+ * as long as the Snapshot is open.
+ */
+class SnapValue
+{
+public:
+    inline Variant::Type type() const
+    {
+        return (Variant::Type)mType;
+    }
+
+    /**
+     * Returns true if null or empty
+     */
+    inline bool empty() const
+    {
+        return (mType == Variant::V_NULL) || (mType == Variant::V_EMPTY);
+    }
+    inline bool isObject() const
+    {
+        return (mType == Variant::V_OBJECT);
+    }
+    inline bool isArray() const
+    {
+        return (mType == Variant::V_ARRAY);
+    }
+    inline bool isString() const
+    {
+        return (mType == Variant::V_STRING);
+    }
+
+    /**
+     * Return the value as an int, converting like Variant::toInt()
+     */
+    longint toInt() const;
+
+    /**
+     * Return the value as a double, converting like Variant::toDouble()
+     */
+    double toDouble() const;
+
+    /**
+     * Return the value as a bool
+     */
+    bool toBool() const;
+
+    /**
+     * Returns a pointer to the null terminated string inside the snapshot.
+     *
+     * NOTE: Returns NULL if not string type.
+     */
+    const char* c_str() const;
+
+    /**
+     * Returns the length of the string, or 0 if not string type
+     */
+    inline size_t strLength() const
+    {
+        return (mType == Variant::V_STRING) ? mLen : 0;
+    }
+
+    /**
+     * Returns the length.  If an array, returns array length.  If an object, returns
+     * the number of properties.  Otherwise, returns 1.
+     */
+    inline int length() const
+    {
+        return (mType == Variant::V_ARRAY || mType == Variant::V_OBJECT) ? (int)mLen : 1;
+    }
+
+    /**
+     * Returns an element of an array, or a property of an object by position
+     */
+    const SnapValue& operator[](int i) const;
+
+    /**
+     * Returns a property of an object.  The key is found by a binary search over the
+     * sorted key table.
+     */
+    const SnapValue& operator[](const char* key) const;
+
+    inline const SnapValue& operator[](const std::string& key) const
+    {
+        return find(key.data(), key.length());
+    }
+
+    /**
+     * Returns a value by parsing properties and indexes using the Variant::path() syntax
+     * (ex: "obj.propA.2.name")
+     *
+     * @param  pathkey property names separated by '.'
+     *
+     * @return         Reference to the value
+     */
+    const SnapValue& path(const char* pathkey) const;
+
+    /**
+     * Returns an iterator to go over all elements in an array or properties of an object
+     * in their original order
+     *
+     * @param  iter Iterator
+     *
+     * @return      Success
+     */
+    bool forEach(Iter<const SnapValue>& iter) const;
+
+    /**
+     * Returns an iterator to go over the properties of an object in sorted order
+     *
+     * @param  iter Iterator
+     *
+     * @return      Success
+     */
+    bool forEachSort(Iter<const SnapValue>& iter) const;
+
+    /**
+     * Copies the value into a Variant, for when a modifiable copy is needed
+     *
+     * @param var Variant to receive the value
+     */
+    void copyTo(Variant& var) const;
+
+    /**
+     * Value returned for missing keys and indexes
+     */
+    static const SnapValue sNull;
+
+private:
+    enum Flags
+    {
+        SF_INLINE = 0x1,    ///< String of up to 7 chars kept in mData
+        SF_CASEINS = 0x2    ///< Object keys are sorted case-insensitive (Variant::makeCI)
+    };
+
+    SnapValue();
+    SnapValue(const SnapValue&);
+    SnapValue& operator=(const SnapValue&);
+
+    inline const char* target() const
+    {
+        return (const char*)this + mData;
+    }
+    const char* key(int pos) const;
+    const SnapValue& find(const char* key, size_t keylen) const;
+
+private:
+    friend class Snapshot;
+
+    uchar mType;
+    uchar mFlags;
+    ushortint mReserved;
+    uint mLen;
+    int64_t mData;
+};
+
+/**
+ * Snapshot is a compact binary image of a Variant which is used without being parsed.
+ * The file is mapped into memory and queried through SnapValue references, so opening a
+ * large data set costs an mmap and the pages are shared by every process using it:
+ * \code
+ *    v.writeSnapshot("data.snap");
+ *    ...
+ *    Snapshot snap;
+ *    if (snap.open("data.snap"))
+ *    {
+ *        const SnapValue& root = snap.root();
+ *        ...
+ *    }
+ * \endcode
+ * Values point to each other with offsets instead of pointers.  Object keys are stored
+ * once with an index in the same sorted order as PropArray's, and repeated keys share one
+ * copy.  Strings of up to 7 chars are kept in the value itself.  Null, empty and function
+ * Variants are stored as null.
+ *
+ * NOTE: Snapshot files must be trusted.  Opening one only checks the header, the trailer
+ * and the root's offset, so it stays as cheap as the mmap.  The offsets and lengths inside
+ * the data are followed as they are by lookups and iteration, and a corrupted or crafted
+ * file makes them read outside of the snapshot.  Snapshots should come from
+ * Snapshot::write() on a machine with the same byte order.  For data from elsewhere,
+ * parse json into a Variant instead.
+ */
+class Snapshot
+{
+public:
+    enum
+    {
+        VERSION = 1
+    };
+
+    Snapshot() :
+        mRoot(&SnapValue::sNull)
+    {
+    }
+
+    /**
+     * Writes a Variant as a snapshot
+     *
+     * @param  var Variant to write
+     * @param  fp  File opened for binary writing, it is flushed when done
+     *
+     * @return     False if writing to the file has failed
+     */
+    static bool write(const Variant& var, FILE* fp);
+
+    /**
+     * Maps a snapshot file.  The file must be trusted, see the class notes.
+     *
+     * @param  filename Name of the file
+     *
+     * @return          Success
+     */
+    bool open(const char* filename);
+
+    /**
+     * Uses a snapshot which is already in memory.  The memory must be aligned to 8 bytes
+     * and stay valid while the snapshot is used, and like a file it must be trusted.
+     *
+     * @param  data Snapshot bytes
+     * @param  len  Number of bytes
+     *
+     * @return      Success
+     */
+    bool attach(const void* data, size_t len);
+
+    /**
+     * Unmaps the file.  References to values become invalid.
+     */
+    void close();
+
+    /**
+     * Returns the top value, or a null value if no snapshot is open
+     */
+    inline const SnapValue& root() const
+    {
+        return *mRoot;
+    }
+
+private:
+    Snapshot(const Snapshot&);
+    Snapshot& operator=(const Snapshot&);
+
+    struct Writer;
+    static void writeValue(Writer& w, Variant& var, SnapValue& rec);
+    static void writeObject(Writer& w, PropArray<Variant>& obj, SnapValue& rec);
+
+private:
+    MappedFile mFile;
+    const SnapValue* mRoot;
+};
+
+} // jvar
+
+#endif // _SNAPSHOT_H
@@ -109,6 +109,19 @@ uint makeUnicode(const char* s, int maxlen, int* lenused = NULL);
  */
 std::string makeUTF8(uint charcode);
 
+/**
+ * Reads the 4 hex digits of a json \\u escape.  A high surrogate followed by the \\u escape
+ * of a low surrogate (\\ud83d\\ude00) is combined into one unicode character.
+ *
+ * @param  s       Text after the "\\u"
+ * @param  maxlen  Number of chars remaining in the text
+ * @param  cp      Receives the unicode character
+ * @param  lenused Receives the number of chars used, 4 or 10
+ *
+ * @return         true if there were 4 hex digits
+ */
+bool readEscapeHex(const char* s, size_t maxlen, uint* cp, int* lenused);
+
 /**
  * Compares strings to see if they are equal (not case-insensitive)
  *
@@ -151,6 +164,33 @@ inline bool strfind(const char* s, char c, int* pos = NULL)
     return false;
 }
 
+/**
+ * Returns the length of the leading run of chars which can be written in a json string
+ * as they are: anything except quotes, backslashes, control chars and non-ASCII chars.
+ * Checks 16 or 32 chars at a time with SSE2 or AVX2.
+ *
+ * @param  s   Text
+ * @param  len Length of the text
+ *
+ * @return     Length of the run
+ */
+size_t jsonPlainLen(const char* s, size_t len);
+
+/**
+ * Size of the buffer needed by int2buf()
+ */
+#define INT2BUF_SIZE 24
+
+/**
+ * Writes the decimal text of an integer, two digits at a time from a table
+ *
+ * @param  n   Integer to convert
+ * @param  buf Buffer of at least INT2BUF_SIZE chars, receives null terminated text
+ *
+ * @return     Length of the text
+ */
+int int2buf(longint n, char* buf);
+
 /**
  * Convert an integer into a string
  *
@@ -168,7 +208,8 @@ std::string int2str(longint n);
  */
 inline void int2str(std::string& s, longint n)
 {
-    format(s, "%ld", n);
+    char buf[INT2BUF_SIZE];
+    s.assign(buf, int2buf(n, buf));
 }
 
 /**
@@ -191,6 +232,37 @@ inline void dbl2str(std::string& s, double d)
     format(s, "%lf", d);
 }
 
+/**
+ * Size of the buffer needed by dbl2buf()
+ */
+#define DBL2BUF_SIZE 32
+
+/**
+ * Writes text which reads back as exactly the same double, usually the shortest such text
+ * (Grisu2 can give a digit more in rare cases).  The format is the same as Javascript's:
+ * 0.001, 12.5, 1e+21, 1.5e-7.  It doesn't depend on the locale.
+ *
+ * @param  d   Double to convert
+ * @param  buf Buffer of at least DBL2BUF_SIZE chars, receives null terminated text
+ *
+ * @return     Length of the text
+ */
+int dbl2buf(double d, char* buf);
+
+/**
+ * Converts a double into a string with a fixed number of digits after the decimal point.
+ * The exact binary value is rounded as printf's "%.*f" does, so 1.005 (which is stored as
+ * 1.00499999...) gives 1.00 and an exact half such as 0.125 rounds to even, 0.12.
+ * Javascript's toFixed() rounds such halves up instead.  Like toFixed(), numbers of 1e21
+ * or more, nan and inf are written as by dbl2buf().  The decimal point is always '.'.
+ *
+ * @param  d    Double to convert
+ * @param  digs Number of digits after the decimal point (0-100)
+ *
+ * @return      String representation of the double
+ */
+std::string dbl2fixed(double d, int digs);
+
 /**
  * Converts a string into an integer
  *
@@ -594,6 +666,24 @@ public:
     bool appendVFmt(const char* fmt, va_list varg);
     bool appendFmt(const char* fmt, ...);
 
+    /**
+     * Appends the decimal text for an integer (see int2buf)
+     */
+    inline void appendInt(longint n)
+    {
+        char* buf = ensureAlloc(mLen + INT2BUF_SIZE);
+        mLen += int2buf(n, buf + mLen);
+    }
+
+    /**
+     * Appends the round-trip text for a double (see dbl2buf)
+     */
+    inline void appendDbl(double d)
+    {
+        char* buf = ensureAlloc(mLen + DBL2BUF_SIZE);
+        mLen += dbl2buf(d, buf + mLen);
+    }
+
     /**
      * Strip quotes from the current token string if found
      *
@@ -630,6 +720,91 @@ private:
 };
 
 
+/**
+ * CharIndex classifies the chars of a text into bitmaps (one bit per char) so a parser
+ * can jump over runs of whitespace, word chars and quoted text instead of looking at one
+ * char at a time.  Classification uses AVX2 or SSE2 when available and is done in windows
+ * of WINDOW chars as the parser moves forward, so memory use does not grow with the text.
+ *
+ * NOTE: Positions should be queried in increasing order, going back re-classifies.
+ */
+class CharIndex
+{
+public:
+    CharIndex() :
+        mTxt(NULL),
+        mTxtLen(0),
+        mBase(0),
+        mEnd(0),
+        mWindowWords(0)
+    {
+    }
+
+    /**
+     * Sets the text to index
+     *
+     * @param txt Text
+     * @param len Length of the text
+     */
+    void init(const char* txt, size_t len);
+
+    /**
+     * Returns the position of the first non-whitespace char at or after \p pos
+     *
+     * @param  pos      Starting position
+     * @param  newlines Incremented by the number of newlines skipped
+     *
+     * @return          Position or the text length if not found
+     */
+    inline size_t skipSpace(size_t pos, int& newlines)
+    {
+        return scan(MAP_SPACE, false, pos, &newlines);
+    }
+
+    /**
+     * Returns the position of the first non-word char (see Parser::charWord) at or
+     * after \p pos
+     */
+    inline size_t skipWord(size_t pos)
+    {
+        return scan(MAP_WORD, false, pos, NULL);
+    }
+
+    /**
+     * Returns the position of the first quote (single or double) or backslash at or
+     * after \p pos
+     */
+    inline size_t findQuote(size_t pos)
+    {
+        return scan(MAP_QUOTE, true, pos, NULL);
+    }
+
+private:
+    enum
+    {
+        MAP_SPACE,
+        MAP_WORD,
+        MAP_QUOTE,
+        MAP_NEWLINE,
+        MAP_COUNT,
+
+        WINDOW = 64 * 1024,
+        WINDOWWORDS = WINDOW / 64
+    };
+
+    size_t scan(int map, bool set, size_t pos, int* newlines);
+    void classify(size_t base);
+
+private:
+    const char* mTxt;
+    size_t mTxtLen;
+    size_t mBase;
+    size_t mEnd;
+    int mWindowWords;
+    Buffer mBits;
+};
+
+
 /**
  * Parser class implements a text parser which follows simple rules to build tokens.
  *    .Sequence of letters, digits, and '_' is a token
@@ -648,6 +823,14 @@ public:
      */
     Parser(const char* txt);
 
+    /**
+     * Constructor for text that is not necessarily null terminated
+     *
+     * @param  txt Text to parse
+     * @param  len Length of the text
+     */
+    Parser(const char* txt, size_t len);
+
     /**
      * Is the entire text parsed
      *
@@ -771,6 +954,61 @@ public:
         mSinglePunc = enable;
     }
 
+    /**
+     * Enables or disables in-situ mode.  In in-situ mode, the text passed to the
+     * constructor is modified: quoted tokens are unescaped in place and null terminated
+     * so they can be used directly via tokInsitu() without copying.
+     */
+    inline void setInsitu(bool enable)
+    {
+        mInsitu = enable;
+    }
+
+    /**
+     * Enables or disables the use of a CharIndex to skip over whitespace, words and
+     * quoted text in bulk.  It pays off for larger texts such as json documents.
+     */
+    void setIndexed(bool enable);
+
+    /**
+     * Returns the unescaped text (without quotes) of the current quoted token when in
+     * in-situ mode, otherwise NULL.
+     *
+     * @param  len Receives the length of the text
+     *
+     * @return     Pointer to the text inside the original text
+     */
+    inline const char* tokInsitu(int& len)
+    {
+        parseToken();
+        len = mInsituLen;
+        return mInsituStr;
+    }
+
+    /**
+     * Returns the text starting at the current token, for callers that scan a token
+     * themselves.  Use restartAt() to continue tokenizing after the scanned text.
+     *
+     * @param  avail Receives the number of chars available from the returned pointer
+     *
+     * @return       Pointer into the original text
+     */
+    inline const char* tokText(size_t& avail)
+    {
+        parseToken();
+        avail = mTxtLen - mTokStartPos;
+        return mTxt + mTokStartPos;
+    }
+
+    /**
+     * Discards the current token and continues tokenizing at \p pos
+     */
+    inline void restartAt(size_t pos)
+    {
+        mPos = pos;
+        mTokParsed = false;
+    }
+
     /**
      * Capture everything up to \p delim into the current token.
      */
@@ -783,18 +1021,18 @@ public:
     std::string tokFullStr()
     {
         std::string s;
-        int l = mTokEndPos - mTokStartPos;
+        size_t l = mTokEndPos - mTokStartPos;
         if (mTokStartPos + l <= mTxtLen)
         {
             s = std::string(mTxt + mTokStartPos, l);
         }
         return s;
     }
-    inline int tokEndPos()
+    inline size_t tokEndPos()
     {
         return mTokEndPos;
     }
-    inline int tokStartPos()
+    inline size_t tokStartPos()
     {
         return mTokStartPos;
     }
@@ -828,14 +1066,19 @@ private:
     const char* mTxt;
     StrBld mToken;
     bool mTokParsed;
-    int mPos;
+    size_t mPos;
     int mLineNum;
     bool mErr;
-    int mTxtLen;
+    size_t mTxtLen;
     std::string mErrMsg;
-    int mTokStartPos;
-    int mTokEndPos;
+    size_t mTokStartPos;
+    size_t mTokEndPos;
     bool mSinglePunc;
+    bool mInsitu;
+    const char* mInsituStr;
+    int mInsituLen;
+    bool mIndexed;
+    CharIndex mIndex;
 
 protected:
     /**
@@ -878,6 +1121,7 @@ private:
     }
 
     void internalParse();
+    void parseQuoteInsitu(char quotec);
     void expectErr(char c, const char* str);
 
     inline void append(char c)
@@ -33,6 +33,7 @@
 
 #ifndef _MSC_VER
 #include <unistd.h>
+#include <pthread.h>
 #endif
 //#include <stdint.h>
 
@@ -317,6 +318,231 @@ private:
 };
 
 
+/**
+ * Arena hands out memory from large blocks by moving a pointer forward.  Allocations are
+ * not freed one by one, they are all given back by free(), which costs one free() per
+ * block.  While an Arena::Scope is active, the objects, arrays and strings of Variants made
+ * on the thread come from the arena (see ArenaDoc).
+ */
+class Arena
+{
+public:
+    enum
+    {
+        BLOCKSIZE = 64 * 1024
+    };
+
+    Arena(size_t blocksize = BLOCKSIZE) :
+        mBlocks(NULL),
+        mCleanups(NULL),
+        mBlockSize(blocksize),
+        mSize(0),
+        mBuilding(false)
+    {
+    }
+
+    ~Arena()
+    {
+        free();
+    }
+
+    /**
+     * Allocates memory aligned to 8 bytes
+     *
+     * @param  size Size in bytes
+     *
+     * @return      Pointer to the memory or NULL if out of memory
+     */
+    void* alloc(size_t size);
+
+    /**
+     * Resizes memory from alloc().  The last allocation grows in place if there's room,
+     * otherwise the memory is copied and the old memory is unused until free().
+     *
+     * @param  ptr     Memory from alloc() or NULL
+     * @param  oldsize Size it was allocated with
+     * @param  newsize New size in bytes
+     *
+     * @return         Pointer to the memory or NULL if out of memory
+     */
+    void* reAlloc(void* ptr, size_t oldsize, size_t newsize);
+
+    /**
+     * Has free() call fn(obj) before the blocks are freed.  Used for objects in the arena
+     * which hold heap memory of their own (the std::string of Variant::s()).
+     *
+     * @param  fn  Function which destroys the object
+     * @param  obj The object
+     *
+     * @return     false if out of memory
+     */
+    bool addCleanup(void (*fn)(void*), void* obj);
+
+    /**
+     * Runs the cleanups and frees all blocks.  Memory from the arena becomes invalid.
+     */
+    void free();
+
+    /**
+     * Returns the number of bytes in blocks
+     */
+    inline size_t size() const
+    {
+        return mSize;
+    }
+
+    /**
+     * Returns true while an ArenaDoc parses into the arena.  The values it makes only get
+     * memory from the arena, so their arrays and objects aren't marked as changed.
+     */
+    inline bool building() const
+    {
+        return mBuilding;
+    }
+
+    /**
+     * Returns the arena of the active Scope on this thread, or NULL
+     */
+    static Arena* current();
+
+    /**
+     * Makes an arena the current one on this thread for the lifetime of the Scope:
+     * \code
+     *    {
+     *        Arena::Scope scope(doc.arena());
+     *        doc.root()["items"].createArray();
+     *        ...
+     *    }
+     * \endcode
+     * NOTE: Every Variant made on the thread while the scope is active takes its arrays,
+     * objects and long strings from the arena, including locals which are not part of a
+     * document.  They die with the arena: such a Variant must not be used, or destroyed,
+     * after the arena is freed.  Keep the scope around the changes to the document only.
+     */
+    class Scope
+    {
+    public:
+        Scope(Arena& arena) :
+            mPrev(current())
+        {
+            setCurrent(&arena);
+        }
+        ~Scope()
+        {
+            setCurrent(mPrev);
+        }
+
+    private:
+        Arena* mPrev;
+    };
+
+private:
+    struct Block
+    {
+        Block* next;
+        size_t size;
+        size_t used;
+    };
+
+    struct Cleanup
+    {
+        Cleanup* next;
+        void (*fn)(void*);
+        void* obj;
+    };
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    static void setCurrent(Arena* arena);
+    friend class Scope;
+    friend class ArenaDoc;
+
+    inline static char* blockData(Block* block)
+    {
+        return (char*)(block + 1);
+    }
+    inline static size_t align(size_t size)
+    {
+        return (size + 7) & ~(size_t)7;
+    }
+
+private:
+    Block* mBlocks;
+    Cleanup* mCleanups;
+    size_t mBlockSize;
+    size_t mSize;
+    bool mBuilding;
+};
+
+
+/**
+ * MappedFile maps a file read-only into memory so it can be used without copying it
+ * into a buffer first.  Pages are loaded on demand by the OS and can be dropped again
+ * under memory pressure.  On platforms without mmap, the file is read into a Buffer.
+ *
+ * NOTE: The data is not null terminated.
+ */
+class MappedFile
+{
+public:
+    MappedFile() :
+        mData(NULL),
+        mSize(0),
+        mMapped(false)
+    {
+    }
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    /**
+     * Maps a file
+     *
+     * @param  filename   Name of the file to map
+     * @param  sequential If True, tell the OS the file will be read from start to end
+     *
+     * @return            Success
+     */
+    bool open(const char* filename, bool sequential = true);
+
+    /**
+     * Unmaps the file
+     */
+    void close();
+
+    /**
+     * Returns a pointer to the file contents
+     */
+    inline const char* data() const
+    {
+        return mData;
+    }
+
+    /**
+     * Returns the size of the file
+     *
+     * @return Number of bytes
+     */
+    inline size_t size() const
+    {
+        return mSize;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+private:
+    const char* mData;
+    size_t mSize;
+    bool mMapped;
+    Buffer mBuf;
+};
+
+
 /**
  * Iter class template is used to iterate over an array as follows:
  * \code
@@ -491,6 +717,125 @@ inline void sleep(int millisecs)
  */
 void tsAddMsecs(struct timespec* ts, longint millisecs);
 
+/**
+ * Returns true if the cpu supports AVX2 instructions (checked once at runtime).
+ * Always false if not built for x86 with gcc or clang.
+ */
+bool cpuHasAvx2();
+
+/**
+ * Returns the number of processors online
+ */
+int cpuCount();
+
+/**
+ * Atomically reads an int shared between threads
+ */
+inline int atomicGet(volatile int* p)
+{
+#ifdef __GNUC__
+    return __sync_fetch_and_add(p, 0);
+#else
+    return *p;
+#endif
+}
+
+/**
+ * Atomically sets an int shared between threads
+ */
+inline void atomicSet(volatile int* p, int val)
+{
+#ifdef __GNUC__
+    (void)__sync_lock_test_and_set(p, val);
+#else
+    *p = val;
+#endif
+}
+
+/**
+ * Atomically adds to an int shared between threads
+ *
+ * @return The new value
+ */
+inline int atomicAdd(volatile int* p, int n)
+{
+#ifdef __GNUC__
+    return __sync_add_and_fetch(p, n);
+#else
+    return (*p += n);
+#endif
+}
+
+/**
+ * WorkerPool runs jobs on a fixed set of threads.  A job is split into a number of tasks
+ * which are picked up by the worker threads and the calling thread:
+ * \code
+ *    void task(void* ctx, int index)
+ *    {
+ *        // work on part 'index' of ctx
+ *    }
+ *    WorkerPool pool;
+ *    pool.run(task, &ctx, 64);
+ * \endcode
+ * run() returns when all the tasks are done.  Only one thread should call run() at a time.
+ * Without thread support, the tasks are run on the calling thread.
+ */
+class WorkerPool
+{
+public:
+    typedef void (*TaskFunc)(void* ctx, int index);
+
+    /**
+     * Constructor
+     *
+     * @param  numthreads Number of threads including the caller.  0 uses one per
+     *                    processor.
+     */
+    WorkerPool(int numthreads = 0);
+    ~WorkerPool();
+
+    /**
+     * Runs \p count tasks and waits for them to finish
+     *
+     * @param func  Function called for each task with \p ctx and the task index
+     * @param ctx   Context passed to \p func
+     * @param count Number of tasks
+     */
+    void run(TaskFunc func, void* ctx, int count);
+
+    /**
+     * Returns the number of threads tasks run on, including the caller
+     */
+    inline int threadCount()
+    {
+        return mNumWorkers + 1;
+    }
+
+private:
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+
+#ifndef _MSC_VER
+    static void* workerMain(void* arg);
+    void work();
+#endif
+
+private:
+    int mNumWorkers;
+    TaskFunc mFunc;
+    void* mCtx;
+    int mCount;
+    int mNext;
+    int mPending;
+    bool mQuit;
+#ifndef _MSC_VER
+    pthread_t* mThreads;
+    pthread_mutex_t mLock;
+    pthread_cond_t mWake;
+    pthread_cond_t mDone;
+#endif
+};
+
 /**
  * Automatically seeds the first time it is called and returns a random
  * between zero and max.
@@ -18,6 +18,7 @@
 
 #if __cplusplus > 199711L
 #include <initializer_list>
+#include <utility>
 #endif
 
 #define VAR_PATH_DELIM     "."
@@ -27,6 +28,7 @@ namespace jvar
 
 class Variant;
 class VarFuncObj;
+class JsonWriter;
 
 /** \cond INTERNAL */
 class VarExtInterface : public jvar::BaseInterface
@@ -71,6 +73,16 @@ public:
         V_POINTER ///< The Variant is a pointer.
     };
 
+    /**
+     * Indentation of json text written by toJsonString() and JsonWriter.  A positive
+     * number indents with that many spaces per level.
+     */
+    enum
+    {
+        JSON_TABS = -1,   ///< New lines and a tab per level.
+        JSON_COMPACT = 0  ///< No whitespace at all.
+    };
+
 public:
 
     /**
@@ -88,6 +100,7 @@ public:
     Variant(longint i)
     {
         mData.type = V_INT;
+        mData.flags = 0;
         mData.intData = i;
     }
 
@@ -97,6 +110,7 @@ public:
     Variant(int i)
     {
         mData.type = V_INT;
+        mData.flags = 0;
         mData.intData = (longint)i;
     }
 
@@ -106,6 +120,7 @@ public:
     Variant(double d)
     {
         mData.type = V_DOUBLE;
+        mData.flags = 0;
         mData.dblData = d;
     }
 
@@ -115,11 +130,9 @@ public:
     Variant(std::string s)
     {
         mData.type = V_STRING;
+        mData.flags = 0;
 
-        // Inplace new a std::string object with the source string passed to
-        // the constructor.
-
-        new (&mData.strMemData) std::string(s);
+        mData.newStr(s);
     }
 
     /**
@@ -128,11 +141,9 @@ public:
     Variant(const char* s)
     {
         mData.type = V_STRING;
+        mData.flags = 0;
 
-        // Inplace new a std::string object with the source string passed to
-        // the constructor.
-
-        new (&mData.strMemData) std::string(s);
+        mData.newStr(s);
     }
 
     /**
@@ -141,16 +152,30 @@ public:
     Variant(Variant const& src)
     {
         mData.type = V_EMPTY;
+        mData.flags = 0;
         *this = src;
     }
 
 #if __cplusplus > 199711L
 
+    /**
+     * Move constructor, takes over the data of \p src (which becomes empty) without
+     * copying it
+     */
+    Variant(Variant&& src)
+    {
+        mData.type = V_EMPTY;
+        mData.flags = 0;
+        moveFrom(src);
+    }
+
     /**
      * Assigns an object literal represented by initializer_list
      */
     Variant(std::initializer_list<const Variant>&& src)
     {
+        mData.type = V_EMPTY;
+        mData.flags = 0;
         assignObj(src);
     }
 
@@ -183,6 +208,17 @@ public:
         return *this;
     }
 
+#if __cplusplus > 199711L
+    /**
+     * Assigns a variant by taking over its data, \p src becomes empty
+     */
+    inline Variant& operator=(Variant&& src)
+    {
+        moveFrom(src);
+        return *this;
+    }
+#endif
+
     /**
      * Assigns a string (changes type if needed)
      */
@@ -421,7 +457,7 @@ public:
     {
         if (mData.type == V_STRING)
         {
-            return mData.strData()->c_str();
+            return mData.strPtr();
         }
         return NULL;
     }
@@ -466,10 +502,58 @@ public:
     /**
      * Returns a json text representing the object.
      *
+     * @param  indent JSON_TABS, JSON_COMPACT or number of spaces to indent with
+     * @param  pool   Optional, serializes a large top level array or object in parallel on
+     *                the pool's threads.  The output is the same.
+     *
      * @return String with Json
      */
-    std::string toJsonString() const;
-    void makeJson(StrBld& sb) const;
+    std::string toJsonString(int indent = JSON_TABS, WorkerPool* pool = NULL) const;
+    void makeJson(StrBld& sb, int indent = JSON_TABS, WorkerPool* pool = NULL) const;
+
+    /**
+     * Returns the variant encoded as MessagePack (see MsgPack)
+     *
+     * @return String with the encoded bytes
+     */
+    std::string toMsgPack() const;
+    void makeMsgPack(StrBld& sb) const;
+
+    /**
+     * Decodes MessagePack into the variant
+     *
+     * @param  data Encoded bytes
+     * @param  len  Number of bytes
+     *
+     * @return      Success
+     */
+    bool parseMsgPack(const char* data, size_t len);
+    inline bool parseMsgPack(const std::string& data)
+    {
+        return parseMsgPack(data.data(), data.length());
+    }
+
+    /**
+     * Returns the variant encoded as CBOR (see Cbor)
+     *
+     * @return String with the encoded bytes
+     */
+    std::string toCbor() const;
+    void makeCbor(StrBld& sb) const;
+
+    /**
+     * Decodes CBOR into the variant
+     *
+     * @param  data Encoded bytes
+     * @param  len  Number of bytes
+     *
+     * @return      Success
+     */
+    bool parseCbor(const char* data, size_t len);
+    inline bool parseCbor(const std::string& data)
+    {
+        return parseCbor(data.data(), data.length());
+    }
 
     /**
      * Parses json text and loads the data structure into the variant
@@ -480,6 +564,18 @@ public:
      */
     bool parseJson(const char* jsontxt);
 
+    /**
+     * Parses json text into the variant like parseJson(), but reuses the memory of the
+     * data already in it.  Objects and arrays keep their buffers, properties which come
+     * in the same order keep their keys, and strings keep their capacity.  Parsing many
+     * messages of the same shape into one variant then doesn't allocate.
+     *
+     * @param  jsontxt Json text string
+     *
+     * @return         Success
+     */
+    bool reparseJson(const char* jsontxt);
+
     bool eq(const char* str);
 
     /**
@@ -565,6 +661,14 @@ public:
      */
     int length() const;
 
+    /**
+     * Makes room for \p count elements in an array or properties in an object, so adding
+     * that many doesn't grow the memory again
+     *
+     * @param count Number of elements or properties
+     */
+    void reserve(int count);
+
     /**
      * Returns a reference to the variant in an array
      */
@@ -642,6 +746,9 @@ public:
      * @return      Pointer to the newly added variant
      */
     Variant* append(const Variant& elem = VEMPTY);
+#if __cplusplus > 199711L
+    Variant* append(Variant&& elem);
+#endif
 
     Variant& appendr()
     {
@@ -656,18 +763,24 @@ public:
     {
         (void)append(elem);
     }
+#if __cplusplus > 199711L
+    inline void push(Variant&& elem)
+    {
+        (void)append(std::move(elem));
+    }
+#endif
 
     /**
      * Removes the last item from the array and returns it
      *
-     * @return Copy of the last element
+     * @return The last element
      */
     Variant pop();
 
     /**
      * Removes the first item from the array and returns it
      *
-     * @return Copy of first item
+     * @return The first item
      */
     Variant shift();
 
@@ -720,6 +833,13 @@ public:
     {
         return addProperty(key.c_str(), value);
     }
+#if __cplusplus > 199711L
+    Variant& addProperty(const char* key, Variant&& value);
+    Variant& addProperty(const std::string key, Variant&& value)
+    {
+        return addProperty(key.c_str(), std::move(value));
+    }
+#endif
 
     /**
      * Adds or modifies (if already exists) property to the object
@@ -786,13 +906,23 @@ public:
      * be used as shorthand if only four arguments are needed.
      */
     Variant operator() (std::initializer_list<const jvar::Variant>&& values);
-#endif
 
+    /**
+     * Executes the function object with up to four parameters.  The parameters are
+     * taken by value and moved into the argument array, so temporaries are not copied.
+     */
+    Variant operator() ();
+    Variant operator() (Variant value1);
+    Variant operator() (Variant value1, Variant value2);
+    Variant operator() (Variant value1, Variant value2, Variant value3);
+    Variant operator() (Variant value1, Variant value2, Variant value3, Variant value4);
+#else
 	Variant operator() ();
     Variant operator() (const Variant& value1);
     Variant operator() (const Variant& value1, const Variant& value2);
     Variant operator() (const Variant& value1, const Variant& value2, const Variant& value3);
     Variant operator() (const Variant& value1, const Variant& value2, const Variant& value3, const Variant& value4);
+#endif
 
     /**
      * Returns an iterator to go over all elements in an array or object
@@ -803,6 +933,9 @@ public:
      */
     inline bool forEach(Iter<Variant>& iter)
     {
+        ensureLoaded();
+        unshare();
+
         if (mData.type == V_ARRAY)
         {
             return mData.arrayData->forEach(iter);
@@ -814,6 +947,34 @@ public:
         return false;
     }
 
+    /**
+     * Returns an iterator to go over all elements in an array or object without changing
+     * them.  Unlike the non-const forEach(), this doesn't make a copy of an array or
+     * object shared with copies (see enableCopyOnWrite()).
+     *
+     * @param  iter Iterator
+     *
+     * @return      Success
+     */
+    inline bool forEach(Iter<const Variant>& iter) const
+    {
+        ensureLoaded();
+
+        iter.mPos++;
+        if (mData.type == V_ARRAY && iter.mPos < mData.arrayData->length())
+        {
+            iter.mObj = mData.arrayData->get(iter.mPos);
+            return true;
+        }
+        else if (mData.type == V_OBJECT && iter.mPos < mData.objectData->length())
+        {
+            iter.mObj = mData.objectData->get(iter.mPos);
+            iter.mKey = mData.objectData->getKey(iter.mPos);
+            return true;
+        }
+        return false;
+    }
+
     /**
      * Clears the object by deleting all data
      */
@@ -851,6 +1012,9 @@ public:
      */
     inline void makeCI()
     {
+        ensureLoaded();
+        unshare();
+
         if (mData.type == V_OBJECT)
         {
             mData.objectData->makeCI();
@@ -868,6 +1032,26 @@ public:
         }
     }
 
+    /**
+     * Makes copies of this array or object, and of the arrays and objects in it, share
+     * the data instead of copying it.  The data is copied, one level at a time, when
+     * either side is changed: append(), addProperty(), the non-const operator[] and
+     * forEach(), assigning, etc.  Copies are cheap then, which suits a tree that is
+     * copied many times and mostly only read:
+     * \code
+     *    config.enableCopyOnWrite();
+     *    ...
+     *    Variant req = config;            // No copy
+     *    req["db"]["host"] = "replica";   // Copies req's top object and "db"
+     * \endcode
+     * Copies can be used from different threads.  References to elements taken before
+     * copying the container point to the shared data, get them again after copying.
+     * Strings longer than fit inline always share their reference counted text buffer
+     * (StrBuf) between copies, it is never changed while shared.  Arrays and objects of a
+     * JsonDoc or ArenaDoc are copied instead of shared, they reference the document.
+     */
+    void enableCopyOnWrite();
+
     /**
      * Don't report an error if a property is missing
      */
@@ -882,6 +1066,36 @@ public:
         return readJsonFile(filename.c_str());
     }
 
+    /**
+     * Writes the variant as json to a file, streaming it out through a JsonWriter
+     *
+     * @param  filename File name, the file is replaced if it exists
+     * @param  indent   JSON_TABS, JSON_COMPACT or number of spaces to indent with
+     * @param  pool     Optional, serializes in parallel (see toJsonString())
+     *
+     * @return          Success
+     */
+    bool writeJsonFile(const char* filename, int indent = JSON_TABS, WorkerPool* pool = NULL) const;
+    inline bool writeJsonFile(const std::string& filename, int indent = JSON_TABS,
+        WorkerPool* pool = NULL) const
+    {
+        return writeJsonFile(filename.c_str(), indent, pool);
+    }
+
+    /**
+     * Writes the variant to a file as a Snapshot, which can be mapped and used without
+     * parsing it
+     *
+     * @param  filename File name, the file is replaced if it exists
+     *
+     * @return          Success
+     */
+    bool writeSnapshot(const char* filename) const;
+    inline bool writeSnapshot(const std::string& filename) const
+    {
+        return writeSnapshot(filename.c_str());
+    }
+
     void newFrom(Variant param);
     void save();
     void load(Variant param);
@@ -896,38 +1110,201 @@ private:
     {
         VF_MODIFIED = 0x1,
         VF_NOMISSINGKEYERR = 0x2,
-        VF_AUTOADDPROP = 0x4
+        VF_AUTOADDPROP = 0x4,
+        VF_STRREF = 0x8,
+        VF_LAZY = 0x10,
+        VF_LAZYFLEX = 0x20,
+        VF_COW = 0x40,      ///< Array or object is shared by copies (enableCopyOnWrite)
+        VF_STRINLINE = 0x80,
+        VF_STRBUF = 0x100,
+        VF_ARENA = 0x200,   ///< Array, object or StrBuf is in an Arena (see ArenaDoc)
+        VF_DOCREF = 0x400,  ///< Array or object parsed in place, may reference document text
+        VF_ARENAMOD = 0x800 ///< Array or object in an Arena which may hold heap values
+    };
+
+    /**
+     * Text of a string value which is too long to be inline.  It is never changed while
+     * shared, copies of the value only add a reference.
+     */
+    struct StrBuf
+    {
+        volatile int refs;
+        uint len;
+        uint cap;
+
+        /**
+         * The null terminated text follows the header
+         */
+        inline char* text()
+        {
+            return (char*)(this + 1);
+        }
     };
 
-    #pragma pack(push, 4)
+    /**
+     * VarData is 16 bytes with the value 8 byte aligned, so arrays of Variants stay dense
+     * and the value is read with aligned loads.
+     *
+     * A string value is one of:
+     *  - VF_STRREF: a pointer to null terminated text owned elsewhere (see JsonDoc)
+     *  - VF_STRINLINE: up to INLINEMAX chars in the 12 bytes after flags.  The last byte
+     *    holds INLINEMAX minus the length, so it is also the null of a full string.
+     *  - VF_STRBUF: a StrBuf, in an arena with VF_ARENA
+     *  - none of these: a std::string, only made by Variant::s() to return a reference.
+     *    It is kept in the union when it fits (the reference counted libstdc++ string is a
+     *    single pointer), otherwise it is allocated on its own.  With VF_ARENA it is
+     *    allocated in an arena, which destroys it when it is freed.
+     */
     struct VarData
     {
+        enum
+        {
+            STRINPLACE = (sizeof(std::string) <= sizeof(void*)),
+            INLINEMAX = 11
+        };
+
         ushortint type;
         shortint flags;
+        uint reserved;
         union
         {
             longint intData;
             double dblData;
             bool boolData;
-            char strMemData[sizeof(std::string)];
+            char strMemData[sizeof(void*)];
+            std::string* strObjData;
+            StrBuf* strBufData;
+            const char* strRefData;
+            const char* lazyData;
             ObjArray<Variant>* arrayData;
             PropArray<Variant>* objectData;
             VarFuncObj* funcData;
             Variant* vptrData;
         };
 
+        inline bool strIsRef() const
+        {
+            return isFlagSet(flags, VF_STRREF);
+        }
+        inline bool strIsStd() const
+        {
+            return isFlagClear(flags, VF_STRREF | VF_STRINLINE | VF_STRBUF);
+        }
+
         std::string* strData() const
+        {
+            assert(type == V_STRING && strIsStd());
+            return (STRINPLACE && isFlagClear(flags, VF_ARENA)) ? (std::string*)&strMemData : strObjData;
+        }
+        inline char* strInline() const
+        {
+            return (char*)&reserved;
+        }
+
+        inline const char* strPtr() const
+        {
+            assert(type == V_STRING);
+            if (isFlagSet(flags, VF_STRINLINE))
+            {
+                return strInline();
+            }
+            else if (isFlagSet(flags, VF_STRBUF))
+            {
+                return strBufData->text();
+            }
+            return strIsRef() ? strRefData : strData()->c_str();
+        }
+        inline size_t strLen() const
         {
             assert(type == V_STRING);
-            return (std::string*)&strMemData;
+            if (isFlagSet(flags, VF_STRINLINE))
+            {
+                return INLINEMAX - (uchar)strInline()[INLINEMAX];
+            }
+            else if (isFlagSet(flags, VF_STRBUF))
+            {
+                return strBufData->len;
+            }
+            return strIsRef() ? strlen(strRefData) : strData()->length();
+        }
+
+        /**
+         * Makes the string of a string value, inline or in a new StrBuf.
+         */
+        void newStr(const char* src, size_t len);
+        inline void newStr(const char* src)
+        {
+            newStr(src, strlen(src));
+        }
+        inline void newStr(const std::string& src)
+        {
+            newStr(src.data(), src.length());
         }
+
+        /**
+         * Replaces the text of a string value, in place if it isn't shared and fits.
+         */
+        void assignStr(const char* src, size_t len);
+
+        /**
+         * Makes the std::string of a string value (see Variant::s()).
+         */
+        template <class T>
+        inline void newStdStr(const T& src)
+        {
+            if (STRINPLACE)
+            {
+                new (&strMemData) std::string(src);
+            }
+            else
+            {
+                strObjData = new std::string(src);
+            }
+        }
+
+        /**
+         * Frees the string of a string value.
+         */
+        void deleteStr();
     };
-    #pragma pack(pop)
 
     VarData mData;
 
 private:
 
+    /**
+     * An object or array parsed with JsonParser::FLAG_LAZY only points at its json
+     * text (with VF_LAZY) until it is first used.  This parses it.
+     */
+    inline void ensureLoaded() const
+    {
+        if (isFlagSet(mData.flags, VF_LAZY))
+        {
+            const_cast<Variant*>(this)->loadLazy();
+        }
+    }
+    void loadLazy();
+
+    /**
+     * Before an array or object is changed, gives the variant its own copy if it is
+     * shared with copies.  One in an arena is marked VF_ARENAMOD, it may be given heap
+     * values (see internalRelease()).  Arena arrays and objects are never shared.
+     */
+    inline void unshare()
+    {
+        if (isFlagSet(mData.flags, VF_COW | VF_ARENA) && isFlagClear(mData.flags, VF_ARENAMOD))
+        {
+            detach();
+        }
+    }
+    void detach();
+
+    /**
+     * Flags of an array or object made in the current arena.  Outside of the parse of an
+     * ArenaDoc it is VF_ARENAMOD too, its elements may be given heap values.
+     */
+    static shortint arenaFlags();
+
     /**
      * Frees all memory related to the data inside the Variant (probably).
      */
@@ -938,6 +1315,16 @@ private:
      */
     void copyFrom(const Variant* src);
 
+    /**
+     * Take over the data of \p src without copying it, \p src becomes empty.
+     */
+    void moveFrom(Variant& src);
+
+    /**
+     * Take over the data of \p src into this Variant which is empty.
+     */
+    void takeData(Variant& src);
+
     /**
      * Assign a \ref longint to this Variant.
      */
@@ -992,13 +1379,27 @@ private:
     }
 	/**
      * Coerce the data in this Variant to a C++ string.
-     * @param[out] s the string to fill.
+     * @param[out] s the string to append to.
+     * @param indent Json indentation (see JSON_TABS).
+     * @param out Optional writer to give a chance to flush \p s between values.
      */
-    void makeString(StrBld& s, int level, bool json);
-	/**
-     * Escape special characters in \p s.
+    void makeString(StrBld& s, int level, bool json, int indent = JSON_TABS, JsonWriter* out = NULL);
+    /**
+     * Append the variant as an element of an array (\p key is NULL) or an object, with
+     * the separator that goes before it.
+     */
+    void makeElement(StrBld& s, int pos, const char* key, int level, bool json, int indent,
+        JsonWriter* out);
+    /**
+     * Append the variant as json, with the elements of a large top level array or object
+     * serialized in ranges on \p pool.  Output is the same as makeString().
      */
-    void jsonifyStr(StrBld& s);
+    void makeJsonParallel(StrBld& s, int indent, WorkerPool& pool, JsonWriter* out);
+    static void jsonRangeTask(void* ctx, int index);
+    /**
+     * Append \p str to \p s with json escapes for special characters.
+     */
+    static void appendJsonStr(StrBld& s, const char* str, size_t len);
 
     inline void appendQuote(StrBld& s, Type type)
     {
@@ -1010,23 +1411,26 @@ private:
 	 /**
      * JSON formatting helper (adds newlines and indentation).
      */
-    inline void appendNewline(StrBld& s, int level, bool json)
+    inline void appendNewline(StrBld& s, int level, bool json, int indent)
     {
-        if (json)
+        if (json && indent != JSON_COMPACT)
         {
             s.append('\n');
-            //s.append(std::string(level, '\t'));
-            for (int i = 0; i < level; i++)
-            {
-                s.append('\t');
-            }
+            appendIndent(s, level, indent);
         }
     }
+    static void appendIndent(StrBld& s, int level, int indent);
 
     Variant* handleMissingKey(const char* key);
 
     static const KeywordArray::Entry sTypeNames[];
 
+    friend class JsonWriter;
+    friend class MsgPack;
+    friend class Cbor;
+    friend class Snapshot;
+    friend class NdjsonReader;
+
 public:
 /** \cond INTERNAL */
     static Variant sEmpty;
@@ -1036,10 +1440,18 @@ public:
     Variant(Type type)
     {
         mData.type = type;
+        mData.flags = 0;
     }
 
     void internalAdd(const Variant& lhs, const Variant& rhs);
     void internalSetPtr(const Variant* v);
+    void internalSetStrRef(const char* s);
+    void internalSetLazy(const char* txt, bool flexquotes);
+    void internalSetDocRef();
+    void internalAssignStr(const char* s, size_t len);
+    bool internalCanReuse(Type type) const;
+    void internalTruncate(int len);
+    void internalRelease();
 
     /** \endcond */
 };
@@ -199,6 +199,22 @@ void BArray::ensureAlloc(int desiredlen)
         return;
     }
 
+    if (isFlagSet(mFlags, FLAG_ARENA))
+    {
+        // Arena memory is only given back with the arena, so the array doesn't shrink.
+
+        if (desiredlen > mMaxLen)
+        {
+            void* p = mArena->reAlloc(mMemPtr, mMaxLen * mElemSize, desiredlen * mElemSize);
+            if (p != NULL)
+            {
+                mMemPtr = p;
+                mMaxLen = desiredlen;
+            }
+        }
+        return;
+    }
+
     mBuf.reAlloc(desiredlen * mElemSize);
 
     mMemPtr = mBuf.ptr();
@@ -209,16 +225,61 @@ void BArray::ensureAlloc(int desiredlen)
 
 void BArray::copyFrom(BArray& src, bool alloconly, bool move)
 {
+    // The array keeps using its own arena, if any.
+
+    bool arena = isFlagSet(mFlags, FLAG_ARENA);
+
     mFlags = src.mFlags;
     mElemSize = src.mElemSize;
     mComp = src.mComp;
     mCountLocal = src.mCountLocal;
     mMaxLen = src.mMaxLen;
 
+    clearFlag(mFlags, FLAG_ARENA);
+    if (arena)
+    {
+        setFlag(mFlags, FLAG_ARENA);
+    }
+
     if (isFlagSet(mFlags, FLAG_FIXEDBUF))
     {
         mMemPtr = src.mMemPtr;
     }
+    else if (arena || isFlagSet(src.mFlags, FLAG_ARENA))
+    {
+        // Memory isn't moved into or out of an arena, it's copied.
+
+        size_t size = src.mMaxLen * mElemSize;
+        if (arena)
+        {
+            mMemPtr = mArena->alloc(size);
+            if (mMemPtr == NULL)
+            {
+                // Out of memory, the array is left empty and src keeps its elements.
+
+                mMaxLen = 0;
+                mCountLocal = 0;
+                size = 0;
+                move = false;
+            }
+        }
+        else
+        {
+            mBuf.reAlloc(size);
+            mMemPtr = mBuf.ptr();
+        }
+
+        if (!alloconly && size > 0)
+        {
+            memcpy(mMemPtr, src.mMemPtr, size);
+        }
+        if (move)
+        {
+            src.mMemPtr = NULL;
+            src.mMaxLen = 0;
+            src.mCountLocal = 0;
+        }
+    }
     else
     {
         if (alloconly)
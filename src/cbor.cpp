@@ -0,0 +1,501 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "cbor.h"
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+
+namespace jvar
+{
+
+// Major types (top 3 bits of the initial byte)
+
+enum
+{
+    CB_UINT = 0,
+    CB_NEGINT = 1,
+    CB_BYTES = 2,
+    CB_TEXT = 3,
+    CB_ARRAY = 4,
+    CB_MAP = 5,
+    CB_TAG = 6,
+    CB_SIMPLE = 7
+};
+
+// Additional info (low 5 bits)
+
+enum
+{
+    CB_AI_1BYTE = 24,
+    CB_AI_8BYTES = 27,
+    CB_AI_INDEFINITE = 31
+};
+
+// Simple values and floats of major type 7
+
+enum
+{
+    CB_FALSE = 20,
+    CB_TRUE = 21,
+    CB_NULL = 22,
+    CB_UNDEFINED = 23,
+    CB_HALF = 25,
+    CB_FLOAT = 26,
+    CB_DOUBLE = 27,
+    CB_BREAK = 0xff
+};
+
+static void putHead(StrBld& out, uchar major, uint64_t v)
+{
+    // Initial byte plus the argument in the fewest bytes, big endian
+
+    char buf[9];
+    int bytes;
+
+    if (v < CB_AI_1BYTE)
+    {
+        out.append((char)((major << 5) | v));
+        return;
+    }
+    else if (v <= 0xff)
+    {
+        bytes = 1;
+    }
+    else if (v <= 0xffff)
+    {
+        bytes = 2;
+    }
+    else if (v <= 0xffffffffUL)
+    {
+        bytes = 4;
+    }
+    else
+    {
+        bytes = 8;
+    }
+
+    static const uchar ai[] = { 0, CB_AI_1BYTE, CB_AI_1BYTE + 1, 0, CB_AI_1BYTE + 2, 0, 0, 0, CB_AI_8BYTES };
+
+    buf[0] = (char)((major << 5) | ai[bytes]);
+    for (int i = bytes; i > 0; i--)
+    {
+        buf[i] = (char)(v & 0xff);
+        v >>= 8;
+    }
+    out.append(buf, bytes + 1);
+}
+
+static void putFloat(StrBld& out, double d)
+{
+    char buf[9];
+    float f = (float)d;
+    int bytes;
+    uint64_t bits;
+
+    if ((double)f == d || d != d)
+    {
+        uint32_t fbits;
+        memcpy(&fbits, &f, sizeof(fbits));
+        bits = fbits;
+        bytes = 4;
+        buf[0] = (char)((CB_SIMPLE << 5) | CB_FLOAT);
+    }
+    else
+    {
+        memcpy(&bits, &d, sizeof(bits));
+        bytes = 8;
+        buf[0] = (char)((CB_SIMPLE << 5) | CB_DOUBLE);
+    }
+
+    for (int i = bytes; i > 0; i--)
+    {
+        buf[i] = (char)(bits & 0xff);
+        bits >>= 8;
+    }
+    out.append(buf, bytes + 1);
+}
+
+static double halfToDouble(uint half)
+{
+    int exp = (half >> 10) & 0x1f;
+    int mant = half & 0x3ff;
+    double val;
+
+    if (exp == 0)
+    {
+        val = ldexp((double)mant, -24);
+    }
+    else if (exp != 31)
+    {
+        val = ldexp((double)(mant + 1024), exp - 25);
+    }
+    else
+    {
+        val = (mant == 0) ? HUGE_VAL : NAN;
+    }
+    return (half & 0x8000) ? -val : val;
+}
+
+void Cbor::encode(const Variant& var, StrBld& out)
+{
+    encodeValue((Variant&)var, out);
+}
+
+void Cbor::encodeValue(Variant& var, StrBld& out)
+{
+    var.ensureLoaded();
+
+    Variant::VarData& data = var.mData;
+    switch (data.type)
+    {
+        case Variant::V_INT:
+        {
+            if (data.intData >= 0)
+            {
+                putHead(out, CB_UINT, (uint64_t)data.intData);
+            }
+            else
+            {
+                putHead(out, CB_NEGINT, (uint64_t)(-1 - data.intData));
+            }
+        }
+        break;
+
+        case Variant::V_DOUBLE:
+        {
+            putFloat(out, data.dblData);
+        }
+        break;
+
+        case Variant::V_BOOL:
+        {
+            out.append((char)((CB_SIMPLE << 5) | (data.boolData ? CB_TRUE : CB_FALSE)));
+        }
+        break;
+
+        case Variant::V_STRING:
+        {
+            const char* s = data.strPtr();
+            size_t len = data.strLen();
+            putHead(out, CB_TEXT, len);
+            out.append(s, (int)len);
+        }
+        break;
+
+        case Variant::V_ARRAY:
+        {
+            int n = data.arrayData->length();
+            putHead(out, CB_ARRAY, n);
+            for (int i = 0; i < n; i++)
+            {
+                encodeValue(*data.arrayData->get(i), out);
+            }
+        }
+        break;
+
+        case Variant::V_OBJECT:
+        {
+            int n = data.objectData->length();
+            putHead(out, CB_MAP, n);
+            for (int i = 0; i < n; i++)
+            {
+                const char* key = data.objectData->getKey(i);
+                size_t keylen = strlen(key);
+                putHead(out, CB_TEXT, keylen);
+                out.append(key, (int)keylen);
+
+                encodeValue(*data.objectData->get(i), out);
+            }
+        }
+        break;
+
+        case Variant::V_POINTER:
+        {
+            if (data.vptrData != NULL)
+            {
+                encodeValue(*data.vptrData, out);
+                break;
+            }
+            out.append((char)((CB_SIMPLE << 5) | CB_NULL));
+        }
+        break;
+
+        default:
+        {
+            // Null, empty and functions
+
+            out.append((char)((CB_SIMPLE << 5) | CB_NULL));
+        }
+    }
+}
+
+bool Cbor::decode(Variant& var, const char* data, size_t len, size_t* used /* = NULL */)
+{
+    const uchar* start = (const uchar*)data;
+    const uchar* end = start + len;
+
+    const uchar* p = decodeValue(var, start, end, 0);
+    if (p == NULL || (used == NULL && p != end))
+    {
+        dbglog("CBOR decoding failed\n");
+        var.clear();
+        return false;
+    }
+
+    if (used != NULL)
+    {
+        *used = p - start;
+    }
+    return true;
+}
+
+/**
+ * Reads the argument of the initial byte at p[-1].  Returns NULL if it is malformed.
+ */
+static const uchar* readArg(const uchar* p, const uchar* end, uchar ai, uint64_t& v, bool& indefinite)
+{
+    indefinite = false;
+
+    if (ai < CB_AI_1BYTE)
+    {
+        v = ai;
+        return p;
+    }
+    else if (ai == CB_AI_INDEFINITE)
+    {
+        indefinite = true;
+        v = 0;
+        return p;
+    }
+    else if (ai > CB_AI_8BYTES)
+    {
+        return NULL;
+    }
+
+    size_t bytes = (size_t)1 << (ai - CB_AI_1BYTE);
+    if ((size_t)(end - p) < bytes)
+    {
+        return NULL;
+    }
+
+    v = 0;
+    for (size_t i = 0; i < bytes; i++)
+    {
+        v = (v << 8) | p[i];
+    }
+    return p + bytes;
+}
+
+const uchar* Cbor::decodeStr(Variant& var, uchar major, uint64_t len, bool indefinite,
+    const uchar* p, const uchar* end)
+{
+    if (!indefinite)
+    {
+        if (len > (uint64_t)(end - p))
+        {
+            return NULL;
+        }
+        var.internalAssignStr((const char*)p, (size_t)len);
+        return p + len;
+    }
+
+    // Definite length chunks of the same major type until a break
+
+    std::string s;
+    for (;;)
+    {
+        if (p >= end)
+        {
+            return NULL;
+        }
+        if (*p == CB_BREAK)
+        {
+            break;
+        }
+        if ((*p >> 5) != major)
+        {
+            return NULL;
+        }
+
+        uint64_t chunklen;
+        bool chunkindef;
+        p = readArg(p + 1, end, *p & 0x1f, chunklen, chunkindef);
+        if (p == NULL || chunkindef || chunklen > (uint64_t)(end - p))
+        {
+            return NULL;
+        }
+        s.append((const char*)p, (size_t)chunklen);
+        p += chunklen;
+    }
+
+    var.internalAssignStr(s.data(), s.length());
+    return p + 1;
+}
+
+const uchar* Cbor::decodeValue(Variant& var, const uchar* p, const uchar* end, int depth)
+{
+    if (p >= end || depth > MAXDEPTH)
+    {
+        return NULL;
+    }
+
+    uchar major = *p >> 5;
+    uchar ai = *p & 0x1f;
+
+    uint64_t v;
+    bool indefinite;
+    p = readArg(p + 1, end, ai, v, indefinite);
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    switch (major)
+    {
+        case CB_UINT:
+        case CB_NEGINT:
+        {
+            if (indefinite)
+            {
+                return NULL;
+            }
+
+            if (v <= (uint64_t)LONG_MAX)
+            {
+                var = (major == CB_UINT) ? (longint)v : -1 - (longint)v;
+            }
+            else
+            {
+                var = (major == CB_UINT) ? (double)v : -1.0 - (double)v;
+            }
+            return p;
+        }
+
+        case CB_BYTES:
+        case CB_TEXT:
+        {
+            return decodeStr(var, major, v, indefinite, p, end);
+        }
+
+        case CB_ARRAY:
+        {
+            // Every item takes at least a byte, so a bad length is caught before reserving.
+            // Arrays and maps can't have more items than an int holds.
+
+            if (!indefinite && (v > (uint64_t)(end - p) || v > INT_MAX))
+            {
+                return NULL;
+            }
+
+            var.createArray();
+            var.reserve((int)v);
+
+            for (uint64_t i = 0; indefinite || i < v; i++)
+            {
+                if (indefinite && p < end && *p == CB_BREAK)
+                {
+                    return p + 1;
+                }
+
+                p = decodeValue(*var.append(VEMPTY), p, end, depth + 1);
+                if (p == NULL)
+                {
+                    return NULL;
+                }
+            }
+            return p;
+        }
+
+        case CB_MAP:
+        {
+            if (!indefinite && (v > (uint64_t)(end - p) / 2 || v > INT_MAX))
+            {
+                return NULL;
+            }
+
+            var.createObject();
+            var.reserve((int)v);
+
+            Variant key;
+            for (uint64_t i = 0; indefinite || i < v; i++)
+            {
+                if (indefinite && p < end && *p == CB_BREAK)
+                {
+                    return p + 1;
+                }
+
+                p = decodeValue(key, p, end, depth + 1);
+                if (p == NULL || key.isArray() || key.isObject())
+                {
+                    return NULL;
+                }
+
+                Variant& prop = var.addOrModifyProperty(key.isString() ? key.c_str() : key.toString().c_str());
+                p = decodeValue(prop, p, end, depth + 1);
+                if (p == NULL)
+                {
+                    return NULL;
+                }
+            }
+            return p;
+        }
+
+        case CB_TAG:
+        {
+            // Tags only add meaning to the item that follows, use the item as is.
+
+            if (indefinite)
+            {
+                return NULL;
+            }
+            return decodeValue(var, p, end, depth + 1);
+        }
+    }
+
+    // Major type 7
+
+    switch (ai)
+    {
+        case CB_FALSE:
+            var = false;
+            return p;
+
+        case CB_TRUE:
+            var = true;
+            return p;
+
+        case CB_NULL:
+        case CB_UNDEFINED:
+            var = VNULL;
+            return p;
+
+        case CB_HALF:
+            var = halfToDouble((uint)v);
+            return p;
+
+        case CB_FLOAT:
+        {
+            uint32_t bits = (uint32_t)v;
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            var = (double)f;
+            return p;
+        }
+
+        case CB_DOUBLE:
+        {
+            double d;
+            memcpy(&d, &v, sizeof(d));
+            var = d;
+            return p;
+        }
+    }
+
+    // Other simple values and a break outside of an indefinite item
+
+    dbglog("CBOR simple value %d not supported\n", (int)ai);
+    return NULL;
+}
+
+} // jvar
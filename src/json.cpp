@@ -2,31 +2,348 @@
 // Released under the MIT License (http://opensource.org/licenses/MIT)
 
 #include "json.h"
+#include <stdint.h>
+#include <limits.h>
+
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <sys/uio.h>
+#endif
 
 namespace jvar
 {
 
+static const double sPow10[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool isDigitChar(char c)
+{
+    return (c >= '0' && c <= '9');
+}
+
+static inline bool isNumTailChar(char c)
+{
+    return (isalnum((uchar)c) || c == '_' || c == '.' || c == '+' || c == '-');
+}
+
+/**
+ * Skips the quoted text starting after the opening \p quotec at \p p.  Returns a pointer
+ * past the closing quote or NULL.  The text ends at \p end or, if \p end is NULL, at a
+ * null char.
+ */
+static const char* skipQuoted(const char* p, const char* end, char quotec)
+{
+    for (; end == NULL || p < end; p++)
+    {
+        char c = *p;
+        if (c == quotec)
+        {
+            return p + 1;
+        }
+        else if (c == '\\')
+        {
+            p++;
+            if (end == NULL && *p == '\0')
+            {
+                break;
+            }
+        }
+        else if (end == NULL && c == '\0')
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Skips the object or array starting at \p p without parsing it, only quotes and
+ * brackets are looked at.  Returns a pointer past the closing bracket or NULL.  The
+ * text ends at \p end or, if \p end is NULL, at a null char.
+ */
+static const char* skipValue(const char* p, const char* end, bool flexquotes)
+{
+    int depth = 0;
+    while (end == NULL || p < end)
+    {
+        char c = *p++;
+        switch (c)
+        {
+            case '{':
+            case '[':
+                depth++;
+                break;
+
+            case '}':
+            case ']':
+                if (--depth == 0)
+                {
+                    return p;
+                }
+                break;
+
+            case '\'':
+                if (!flexquotes)
+                {
+                    break;
+                }
+                // fall through
+            case '"':
+                p = skipQuoted(p, end, c);
+                if (p == NULL)
+                {
+                    return NULL;
+                }
+                break;
+
+            case '\0':
+                if (end == NULL)
+                {
+                    return NULL;
+                }
+                break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Scans the json number at \p start into \p var in one pass.  Up to 20 significant
+ * digits are accumulated into an integer mantissa, which is then converted.  Returns
+ * a pointer past the number, or past the malformed text when \p valid is false.
+ */
+static const char* scanNum(const char* start, const char* end, Variant& var, bool& valid)
+{
+    const char* p = start;
+
+    bool neg = false;
+    if (p < end && *p == '-')
+    {
+        neg = true;
+        p++;
+    }
+
+    valid = true;
+    bool isint = true;
+    bool truncated = false;
+    uint64_t mant = 0;
+    int exp10 = 0;
+
+    const char* intstart = p;
+    while (p < end && isDigitChar(*p))
+    {
+        uint d = *p - '0';
+        if (mant <= (~(uint64_t)0 - d) / 10)
+        {
+            mant = mant * 10 + d;
+        }
+        else
+        {
+            truncated = true;
+            exp10++;
+        }
+        p++;
+    }
+    if (p == intstart || (p - intstart > 1 && *intstart == '0'))
+    {
+        // In json, ints are not allowed to start with zero
+        valid = false;
+    }
+
+    if (p < end && *p == '.')
+    {
+        isint = false;
+        p++;
+
+        const char* fracstart = p;
+        while (p < end && isDigitChar(*p))
+        {
+            uint d = *p - '0';
+            if (mant <= (~(uint64_t)0 - d) / 10)
+            {
+                mant = mant * 10 + d;
+                exp10--;
+            }
+            else
+            {
+                truncated = true;
+            }
+            p++;
+        }
+        if (p == fracstart)
+        {
+            valid = false;
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        isint = false;
+        p++;
+
+        bool expneg = false;
+        if (p < end && (*p == '+' || *p == '-'))
+        {
+            expneg = (*p == '-');
+            p++;
+        }
+
+        const char* expstart = p;
+        int e = 0;
+        while (p < end && isDigitChar(*p))
+        {
+            if (e < 100000)
+            {
+                e = e * 10 + (*p - '0');
+            }
+            p++;
+        }
+        if (p == expstart)
+        {
+            valid = false;
+        }
+        exp10 += expneg ? -e : e;
+    }
+
+    // Anything number-like right after the number, like in 1.2.3 or 12abc, is an error
+
+    if (p < end && isNumTailChar(*p))
+    {
+        valid = false;
+    }
+
+    if (!valid)
+    {
+        while (p < end && isNumTailChar(*p))
+        {
+            p++;
+        }
+
+        var = VNULL;
+        return p;
+    }
+
+    // Variant ints are signed 64 bits, larger integers become the nearest double.
+
+    if (isint && !truncated && mant <= (uint64_t)LONG_MAX + (neg ? 1 : 0))
+    {
+        var = neg ? (longint)(0 - mant) : (longint)mant;
+        return p;
+    }
+
+    // Both the mantissa and the power of 10 are exact doubles so a single multiply or
+    // divide gives the correctly rounded result (Clinger's fast path).  A power above
+    // 10^22 is still fine if the mantissa times its excess stays below 2^53, as in 12e25.
+
+    const uint64_t maxexact = (uint64_t)1 << 53;
+    if (!truncated && exp10 > 22 && exp10 <= 22 + 15 &&
+        mant <= maxexact / (uint64_t)sPow10[exp10 - 22])
+    {
+        mant *= (uint64_t)sPow10[exp10 - 22];
+        exp10 = 22;
+    }
+
+    if (!truncated && mant <= maxexact && exp10 >= -22 && exp10 <= 22)
+    {
+        double dbl = (double)mant;
+        if (exp10 < 0)
+        {
+            dbl /= sPow10[-exp10];
+        }
+        else
+        {
+            dbl *= sPow10[exp10];
+        }
+        var = neg ? -dbl : dbl;
+        return p;
+    }
+
+    // Uncommon: too many digits or a large exponent.  strtod() stops at the same char the
+    // scan did, so it reads the text in place unless the number runs up to the end, which
+    // may not be terminated.
+
+    size_t len = p - start;
+    char buf[64];
+    if (p < end)
+    {
+        var = strtod(start, NULL);
+    }
+    else if (len < sizeof(buf))
+    {
+        memcpy(buf, start, len);
+        buf[len] = '\0';
+        var = strtod(buf, NULL);
+    }
+    else
+    {
+        std::string numstr(start, len);
+        var = strtod(numstr.c_str(), NULL);
+    }
+    return p;
+}
+
 JsonParser::JsonParser(Variant& outvar, const char* jsontxt, uint flags /*= 0*/) :
     Parser(jsontxt),
-    mFlags(flags)
+    mFlags(flags),
+    mHandler(NULL)
+{
+    parseDoc(outvar);
+}
+
+JsonParser::JsonParser(JsonHandler& handler, const char* jsontxt, uint flags /*= 0*/) :
+    Parser(jsontxt),
+    mFlags(flags),
+    mHandler(&handler)
+{
+    // With a handler, all values are parsed into the same scratch variant which is
+    // then passed to the handler.
+
+    parseDoc(mValue);
+}
+
+JsonParser::JsonParser(Variant& outvar, const char* jsontxt, size_t len, uint flags) :
+    Parser(jsontxt, len),
+    mFlags(flags),
+    mHandler(NULL)
+{
+    parseDoc(outvar);
+}
+
+JsonParser::JsonParser(JsonHandler& handler, const char* jsontxt, size_t len, uint flags) :
+    Parser(jsontxt, len),
+    mFlags(flags),
+    mHandler(&handler)
+{
+    parseDoc(mValue);
+}
+
+
+void JsonParser::parseDoc(Variant& var)
 {
+    setInsitu(isFlagSet(mFlags, FLAG_INSITU));
+    setIndexed(true);
+
     if (isFlagSet(mFlags, FLAG_ARRAYONLY))
     {
-        parseArray(outvar);
+        parseArray(var);
     }
     else if (isFlagSet(mFlags, FLAG_OBJECTONLY))
     {
-        parseObject(outvar);
+        parseObject(var);
     }
     else
     {
         if (tokenEquals('['))
         {
-            parseArray(outvar);
+            parseArray(var);
         }
         else
         {
-            parseObject(outvar);
+            parseObject(var);
         }
     }
 
@@ -53,10 +370,26 @@ void JsonParser::parseObject(Variant& var)
 
     advance('{');
 
-    var.createObject();
+    if (mHandler)
+    {
+        handled(mHandler->onStartObject());
+    }
+    else if (isFlagClear(mFlags, FLAG_REUSE) || !var.internalCanReuse(Variant::V_OBJECT))
+    {
+        var.createObject();
+    }
+    if (isFlagSet(mFlags, FLAG_INSITU) && !mHandler)
+    {
+        var.internalSetDocRef();
+    }
 
     parseMembers(var);
     advance('}');
+
+    if (mHandler && !failed())
+    {
+        handled(mHandler->onEndObject());
+    }
 }
 
 void JsonParser::parseMembers(Variant& var)
@@ -67,18 +400,30 @@ void JsonParser::parseMembers(Variant& var)
     // pair
     //    string : value
 
-    StrBld key;
+    bool reuse = isFlagSet(mFlags, FLAG_REUSE);
+    int n = 0;
+
     while (!tokenEquals('}') && !failed())
     {
         // A property/key name can be a string.  Quotes can be single or double and
         // are optional in some cases.
 
-        key.clear();
+        mKey.clear();
+
+        const char* keyname = "";
+        int keylen = 0;
 
         if (isString(token(), false))
         {
-            token().stripQuotes(isFlagSet(mFlags, FLAG_FLEXQUOTES));
-            key.moveFrom(token());
+            keyname = tokInsitu(keylen);
+            if (keyname == NULL)
+            {
+                token().stripQuotes(isFlagSet(mFlags, FLAG_FLEXQUOTES));
+                mKey.append(token());
+
+                keyname = mKey.c_str();
+                keylen = mKey.length();
+            }
 
             advance();
         }
@@ -88,9 +433,22 @@ void JsonParser::parseMembers(Variant& var)
         // in the array. While JSON standard don't say what the right behavior is, jvar
         // follows the JavaScript behavior and the value is set to the very last value set.
 
-        Variant& newprop = var.addOrModifyProperty(key.c_str());
+        if (mHandler)
+        {
+            handled(mHandler->onKey(keyname, keylen));
+
+            parseValue(var);
+        }
+        else if (reuse)
+        {
+            parseValue(reuseProperty(var, n, keyname));
+        }
+        else
+        {
+            Variant& newprop = var.addOrModifyProperty(keyname);
 
-        parseValue(newprop);
+            parseValue(newprop);
+        }
 
         if (tokenEquals(','))
         {
@@ -101,6 +459,30 @@ void JsonParser::parseMembers(Variant& var)
             }
         }
     }
+
+    if (reuse && !mHandler)
+    {
+        // Drop the properties the new document doesn't have.
+
+        var.internalTruncate(n);
+    }
+}
+
+Variant& JsonParser::reuseProperty(Variant& var, int& n, const char* keyname)
+{
+    const char* key = var.getKey(n);
+    if (key != NULL && strcmp(key, keyname) == 0)
+    {
+        return var[n++];
+    }
+
+    var.internalTruncate(n);
+    Variant& prop = var.addOrModifyProperty(keyname);
+
+    // A duplicate key modifies an earlier property, so count what is there.
+
+    n = var.length();
+    return prop;
 }
 
 void JsonParser::parseArray(Variant& var)
@@ -110,9 +492,27 @@ void JsonParser::parseArray(Variant& var)
     //    [ elements ]
 
     advance('[');
-    var.createArray();
+
+    if (mHandler)
+    {
+        handled(mHandler->onStartArray());
+    }
+    else if (isFlagClear(mFlags, FLAG_REUSE) || !var.internalCanReuse(Variant::V_ARRAY))
+    {
+        var.createArray();
+    }
+    if (isFlagSet(mFlags, FLAG_INSITU) && !mHandler)
+    {
+        var.internalSetDocRef();
+    }
+
     parseElements(var);
     advance(']');
+
+    if (mHandler && !failed())
+    {
+        handled(mHandler->onEndArray());
+    }
 }
 
 
@@ -122,16 +522,31 @@ void JsonParser::parseElements(Variant& var)
     //    value
     //    value , elements
 
+    bool reuse = isFlagSet(mFlags, FLAG_REUSE);
+    int n = 0;
+
     while (!tokenEquals(']') && !failed())
     {
         // Variant v;
         // parseValue(v);
         // var.append(v);
 
-        Variant* v = var.append(VEMPTY);
-        if (v)
+        if (mHandler)
+        {
+            parseValue(var);
+        }
+        else if (reuse && n < var.length())
         {
-            parseValue(*v);
+            parseValue(var[n++]);
+        }
+        else
+        {
+            n++;
+            Variant* v = var.append(VEMPTY);
+            if (v)
+            {
+                parseValue(*v);
+            }
         }
 
         if (tokenEquals(','))
@@ -143,6 +558,11 @@ void JsonParser::parseElements(Variant& var)
             }
         }
     }
+
+    if (reuse && !mHandler)
+    {
+        var.internalTruncate(n);
+    }
 }
 
 void JsonParser::parseValue(Variant& var)
@@ -156,17 +576,26 @@ void JsonParser::parseValue(Variant& var)
     //    false
     //    null
 
-    if (isNum(token()))
+    if ((isArray(token()) || isObject(token())) && isFlagSet(mFlags, FLAG_LAZY) && !mHandler)
     {
-        parseNum(var);
+        skipLazy(var);
+        return;
     }
-    else if (isArray(token()))
+
+    if (isArray(token()))
     {
         parseArray(var);
+        return;
     }
     else if (isObject(token()))
     {
         parseObject(var);
+        return;
+    }
+
+    if (isNum(token()))
+    {
+        parseNum(var);
     }
     else if (tokenEquals("true"))
     {
@@ -197,93 +626,103 @@ void JsonParser::parseValue(Variant& var)
         format(err, "Invalid value '%s'", token().c_str());
         setError(err.c_str());
     }
+
+    if (mHandler && !failed())
+    {
+        handled(mHandler->onValue(var));
+    }
 }
 
 
-void JsonParser::parseNum(Variant& var)
+void JsonParser::skipLazy(Variant& var)
 {
-    // number
-    //    int
-    //    int frac
-    //    int exp
-    //    int frac exp
+    size_t avail;
+    const char* start = tokText(avail);
 
-    StrBld num;
-    for (;;)
+    const char* p = skipValue(start, start + avail, isFlagSet(mFlags, FLAG_FLEXQUOTES));
+    if (p == NULL)
     {
-        char c = token()[0];
-        if (!isDigit(c) && c != '+' && c != '-' && c != 'e' && c != 'E' && c != '.')
-        {
-            break;
-        }
-        num.append(token());
-        advance();
+        setError("Unterminated object or array");
+        return;
     }
-    const char* numstr = num.c_str();
 
-    bool isint = num.length() < 20;
-    if (isint)
-    {
-        const char* p = numstr;
-        while (*p)
-        {
-            if (*p == 'e' || *p == 'E' || *p == '.')
-            {
-                isint = false;
-                break;
-            }
-            p++;
-        }
-    }
+    var.internalSetLazy(start, isFlagSet(mFlags, FLAG_FLEXQUOTES));
+    restartAt(tokStartPos() + (p - start));
+}
+
+bool JsonParser::parseLazy(Variant& var, const char* txt, uint flags)
+{
+    // The value was skipped over before so its end is known to be there.
 
-    bool valid = false;
-    if (isint)
+    const char* end = skipValue(txt, NULL, isFlagSet(flags, FLAG_FLEXQUOTES));
+    if (end == NULL)
     {
-        if (num.length() >= 2 && *numstr == '0')
-        {
-            // In json, ints are not allowed to start with zero, invalid
-        }
-        else
-        {
-            char* ench;
-            longint li = strtol(numstr, &ench, 10);
-            if (*ench == '\0')
-            {
-                valid = true;
-                var = li;
-            }
-        }
+        return false;
     }
-    else
+
+    JsonParser json(var, txt, end - txt, flags);
+    if (json.failed())
     {
-        char* ench;
-        double dbl = strtod(numstr, &ench);
-        if (*ench == '\0')
-        {
-            valid = true;
-            var = dbl;
-        }
+        var.clear();
+        return false;
     }
+    return true;
+}
+
+void JsonParser::parseNum(Variant& var)
+{
+    // number
+    //    int
+    //    int frac
+    //    int exp
+    //    int frac exp
+    //
+    // The number is scanned directly from the text.
+
+    size_t avail;
+    const char* start = tokText(avail);
 
+    bool valid;
+    const char* p = scanNum(start, start + avail, var, valid);
     if (!valid)
     {
-        var = VNULL;
         std::string err;
-        format(err, "Invalid number '%s'", numstr);
+        format(err, "Invalid number '%s'", std::string(start, p - start).c_str());
         setError(err.c_str());
+        return;
     }
+
+    restartAt(tokStartPos() + (p - start));
 }
 
 
 void JsonParser::parseString(Variant& var)
 {
-    token().stripQuotes(isFlagSet(mFlags, FLAG_FLEXQUOTES));
-    var = token().toString();
-    advance();
-}
+    int len;
+    const char* insitu = tokInsitu(len);
 
-bool JsonParser::isString(StrBld& s, bool requirequotes)
-{
+    if (insitu == NULL)
+    {
+        token().stripQuotes(isFlagSet(mFlags, FLAG_FLEXQUOTES));
+        var.internalAssignStr(token().c_str(), token().length());
+    }
+    else if (memchr(insitu, '\0', len) == NULL)
+    {
+        // Reference the text in place.
+
+        var.internalSetStrRef(insitu);
+    }
+    else
+    {
+        // An escaped null char in the string, can't be referenced as null terminated.
+
+        var = std::string(insitu, len);
+    }
+    advance();
+}
+
+bool JsonParser::isString(StrBld& s, bool requirequotes)
+{
     int l = s.length();
     bool flexquotes = isFlagSet(mFlags, FLAG_FLEXQUOTES);
 
@@ -332,4 +771,1490 @@ bool JsonParser::isString(StrBld& s, bool requirequotes)
     return false;
 }
 
+// JsonDoc::
+
+bool JsonDoc::parse(const char* jsontxt)
+{
+    assert(jsontxt);
+
+    // Clear the root first as it may reference the old text.
+
+    mRoot.clear();
+
+    size_t len = strlen(jsontxt);
+    mTxt.reAlloc(len + 1);
+    if (mTxt.ptr() == NULL)
+    {
+        return false;
+    }
+    memcpy(mTxt.ptr(), jsontxt, len + 1);
+
+    return parseTxt();
+}
+
+bool JsonDoc::readFile(const char* filename)
+{
+    mRoot.clear();
+
+    if (!mTxt.readFile(filename, true))
+    {
+        dbgerr("Failed to json read file: %s\n", filename);
+        return false;
+    }
+    return parseTxt();
+}
+
+void JsonDoc::clear()
+{
+    mRoot.clear();
+    mTxt.free();
+}
+
+bool JsonDoc::parseTxt()
+{
+    JsonParser json(mRoot, (const char*)mTxt.cptr(), JsonParser::FLAG_INSITU | mFlags);
+    if (json.failed())
+    {
+        mRoot.clear();
+        return false;
+    }
+    return true;
+}
+
+// ArenaDoc::
+
+bool ArenaDoc::parse(const char* jsontxt)
+{
+    assert(jsontxt);
+
+    clear();
+    return parseTxt(jsontxt, strlen(jsontxt));
+}
+
+bool ArenaDoc::readFile(const char* filename)
+{
+    clear();
+
+    MappedFile file;
+    if (!file.open(filename, true))
+    {
+        dbgerr("Failed to json read file: %s\n", filename);
+        return false;
+    }
+    return parseTxt(file.data(), file.size());
+}
+
+void ArenaDoc::clear()
+{
+    mRoot.internalRelease();
+    mArena.free();
+}
+
+bool ArenaDoc::parseTxt(const char* jsontxt, size_t len)
+{
+    // The text is parsed in-situ from a copy in the arena, so nothing is allocated
+    // outside of it.
+
+    char* txt = (char*)mArena.alloc(len + 1);
+    if (txt == NULL)
+    {
+        return false;
+    }
+    memcpy(txt, jsontxt, len);
+    txt[len] = '\0';
+
+    Arena::Scope scope(mArena);
+
+    mArena.mBuilding = true;
+    JsonParser json(mRoot, txt, JsonParser::FLAG_INSITU | mFlags);
+    mArena.mBuilding = false;
+
+    if (json.failed())
+    {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+// JsonHandler::
+
+bool JsonHandler::onStartObject()
+{
+    return true;
+}
+
+bool JsonHandler::onKey(const char* key, int len)
+{
+    return true;
+}
+
+bool JsonHandler::onEndObject()
+{
+    return true;
+}
+
+bool JsonHandler::onStartArray()
+{
+    return true;
+}
+
+bool JsonHandler::onEndArray()
+{
+    return true;
+}
+
+bool JsonHandler::onValue(const Variant& value)
+{
+    return true;
+}
+
+
+// JsonBuilder::
+
+JsonBuilder::JsonBuilder(Variant& outvar) :
+    mRoot(outvar),
+    mStack(sizeof(Variant*), NULL)
+{
+}
+
+void JsonBuilder::reset()
+{
+    mStack.clear();
+    mKey.clear();
+}
+
+Variant* JsonBuilder::place()
+{
+    // Returns where the next value goes: the root, the end of the current array or
+    // the property named by the last key.
+
+    int len = mStack.length();
+    if (len == 0)
+    {
+        return &mRoot;
+    }
+
+    Variant* top = *(Variant**)mStack.get(len - 1);
+    if (top->isArray())
+    {
+        return top->append(VEMPTY);
+    }
+    return &top->addOrModifyProperty(mKey.c_str());
+}
+
+bool JsonBuilder::onStartObject()
+{
+    Variant* v = place();
+    if (v == NULL)
+    {
+        return false;
+    }
+    v->createObject();
+    mStack.append(&v);
+    return true;
+}
+
+bool JsonBuilder::onKey(const char* key, int len)
+{
+    mKey.assign(key, len);
+    return true;
+}
+
+bool JsonBuilder::onEndObject()
+{
+    return mStack.remove(mStack.length() - 1);
+}
+
+bool JsonBuilder::onStartArray()
+{
+    Variant* v = place();
+    if (v == NULL)
+    {
+        return false;
+    }
+    v->createArray();
+    mStack.append(&v);
+    return true;
+}
+
+bool JsonBuilder::onEndArray()
+{
+    return mStack.remove(mStack.length() - 1);
+}
+
+bool JsonBuilder::onValue(const Variant& value)
+{
+    Variant* v = place();
+    if (v == NULL)
+    {
+        return false;
+    }
+    *v = value;
+    return true;
+}
+
+
+// JsonPushParser::
+
+JsonPushParser::JsonPushParser(Variant& outvar) :
+    mBuilder(outvar),
+    mHandler(&mBuilder),
+    mOutVar(&outvar)
+{
+    reset();
+}
+
+JsonPushParser::JsonPushParser(JsonHandler& handler) :
+    mBuilder(mValue),
+    mHandler(&handler),
+    mOutVar(NULL)
+{
+    // The builder is not used with a handler.
+
+    reset();
+}
+
+void JsonPushParser::reset()
+{
+    mBuilder.reset();
+
+    mLex = LEX_NONE;
+    mExpect = EXP_VALUE;
+    mNest.clear();
+    mTok.clear();
+    mIsKey = false;
+    mEmpty = false;
+    mEscape = false;
+    mHexLeft = 0;
+    mHex = 0;
+    mHighSurrogate = 0;
+
+    mLineNum = 1;
+    mErr = false;
+    mErrMsg.clear();
+}
+
+bool JsonPushParser::feed(const char* data, size_t len)
+{
+    const char* p = data;
+    const char* end = data + len;
+
+    while (p < end && !mErr)
+    {
+        if (mLex == LEX_STRING)
+        {
+            p = lexString(p, end);
+            continue;
+        }
+
+        if (mLex == LEX_WORD)
+        {
+            // A number or literal continues until a char that can't be part of it.
+            // It may continue in the next chunk.
+
+            const char* start = p;
+            while (p < end && isNumTailChar(*p))
+            {
+                p++;
+            }
+            mTok.append(start, (int)(p - start));
+
+            if (p == end || !endWord())
+            {
+                break;
+            }
+        }
+
+        char c = *p++;
+        if (c == '\n')
+        {
+            mLineNum++;
+        }
+        else if (!isspace((uchar)c))
+        {
+            structural(c);
+        }
+    }
+
+    return !mErr;
+}
+
+bool JsonPushParser::finish()
+{
+    if (!mErr && mLex == LEX_WORD)
+    {
+        endWord();
+    }
+    if (!mErr && (mLex != LEX_NONE || mExpect != EXP_DONE))
+    {
+        setError("Unexpected end of input");
+    }
+
+    if (mErr && mOutVar)
+    {
+        mOutVar->clear();
+    }
+    return !mErr;
+}
+
+const char* JsonPushParser::lexString(const char* p, const char* end)
+{
+    while (p < end && !mErr)
+    {
+        if (mHexLeft > 0)
+        {
+            char c = *p++;
+            int h;
+            if (isDigitChar(c))
+            {
+                h = c - '0';
+            }
+            else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            {
+                h = (c | 0x20) - 'a' + 10;
+            }
+            else
+            {
+                setError("Invalid \\u escape");
+                break;
+            }
+
+            mHex = mHex * 16 + h;
+            if (--mHexLeft == 0)
+            {
+                // A high surrogate waits for the low one of the pair in the next escape.
+
+                if (mHighSurrogate != 0 && mHex >= 0xDC00 && mHex < 0xE000)
+                {
+                    mTok.append(makeUTF8(0x10000 + ((mHighSurrogate - 0xD800) << 10) +
+                        (mHex - 0xDC00)));
+                    mHighSurrogate = 0;
+                }
+                else
+                {
+                    flushSurrogate();
+                    if (mHex >= 0xD800 && mHex < 0xDC00)
+                    {
+                        mHighSurrogate = mHex;
+                    }
+                    else
+                    {
+                        mTok.append(makeUTF8(mHex));
+                    }
+                }
+            }
+            continue;
+        }
+
+        if (mEscape)
+        {
+            char c = *p++;
+            int pos;
+
+            mEscape = false;
+            if (strfind(ESCAPE_CODES, c, &pos))
+            {
+                flushSurrogate();
+                mTok.append(ESCAPE_CHARS[pos]);
+            }
+            else if (c == 'u')
+            {
+                mHexLeft = 4;
+                mHex = 0;
+            }
+            else
+            {
+                setError("Illegal escape char");
+            }
+            continue;
+        }
+
+        // Copy the run of plain chars at once.
+
+        const char* start = p;
+        while (p < end && *p != '"' && *p != '\\')
+        {
+            if (*p == '\n')
+            {
+                mLineNum++;
+            }
+            p++;
+        }
+        if (p > start || (p < end && *p == '"'))
+        {
+            flushSurrogate();
+        }
+        mTok.append(start, (int)(p - start));
+
+        if (p == end)
+        {
+            break;
+        }
+        if (*p++ == '\\')
+        {
+            mEscape = true;
+            continue;
+        }
+
+        // Closing quote
+
+        mLex = LEX_NONE;
+        if (mIsKey)
+        {
+            handled(mHandler->onKey(mTok.c_str(), mTok.length()));
+            mExpect = EXP_COLON;
+        }
+        else
+        {
+            mValue = mTok.toString();
+            if (handled(mHandler->onValue(mValue)))
+            {
+                afterValue();
+            }
+        }
+        break;
+    }
+    return p;
+}
+
+void JsonPushParser::flushSurrogate()
+{
+    // A high surrogate not followed by a low one is kept as is.
+
+    if (mHighSurrogate != 0)
+    {
+        mTok.append(makeUTF8(mHighSurrogate));
+        mHighSurrogate = 0;
+    }
+}
+
+bool JsonPushParser::endWord()
+{
+    const char* tok = mTok.c_str();
+    int len = mTok.length();
+
+    mLex = LEX_NONE;
+
+    if (isDigitChar(tok[0]) || tok[0] == '-')
+    {
+        bool valid;
+        if (scanNum(tok, tok + len, mValue, valid) != tok + len || !valid)
+        {
+            std::string err;
+            format(err, "Invalid number '%s'", tok);
+            setError(err.c_str());
+            return false;
+        }
+    }
+    else if (mTok.equals("true"))
+    {
+        mValue = true;
+    }
+    else if (mTok.equals("false"))
+    {
+        mValue = false;
+    }
+    else if (mTok.equals("null"))
+    {
+        mValue = VNULL;
+    }
+    else
+    {
+        std::string err;
+        format(err, "Invalid value '%s'", tok);
+        setError(err.c_str());
+        return false;
+    }
+
+    if (!handled(mHandler->onValue(mValue)))
+    {
+        return false;
+    }
+    afterValue();
+    return true;
+}
+
+bool JsonPushParser::structural(char c)
+{
+    switch (c)
+    {
+        case '{':
+        case '[':
+        {
+            if (mExpect != EXP_VALUE)
+            {
+                break;
+            }
+            mNest.append(c);
+            mEmpty = true;
+
+            if (c == '{')
+            {
+                mExpect = EXP_KEY;
+                return handled(mHandler->onStartObject());
+            }
+            mExpect = EXP_VALUE;
+            return handled(mHandler->onStartArray());
+        }
+
+        case '}':
+        case ']':
+        {
+            // Closes the innermost container, after a value or when it's empty.
+
+            char open = (c == '}') ? '{' : '[';
+            ExpectEnum expempty = (c == '}') ? EXP_KEY : EXP_VALUE;
+
+            if (mNest.empty() || mNest[mNest.length() - 1] != open ||
+                !(mExpect == EXP_NEXT || (mEmpty && mExpect == expempty)))
+            {
+                break;
+            }
+            mNest.eraseLast();
+
+            if (!handled((c == '}') ? mHandler->onEndObject() : mHandler->onEndArray()))
+            {
+                return false;
+            }
+            afterValue();
+            return true;
+        }
+
+        case ',':
+        {
+            if (mExpect != EXP_NEXT)
+            {
+                break;
+            }
+            mExpect = (mNest[mNest.length() - 1] == '{') ? EXP_KEY : EXP_VALUE;
+            mEmpty = false;
+            return true;
+        }
+
+        case ':':
+        {
+            if (mExpect != EXP_COLON)
+            {
+                break;
+            }
+            mExpect = EXP_VALUE;
+            return true;
+        }
+
+        case '"':
+        {
+            if (!(mExpect == EXP_KEY || (mExpect == EXP_VALUE && !mNest.empty())))
+            {
+                break;
+            }
+            mIsKey = (mExpect == EXP_KEY);
+            mLex = LEX_STRING;
+            mTok.clear();
+            mEscape = false;
+            mHexLeft = 0;
+            mHighSurrogate = 0;
+            return true;
+        }
+
+        default:
+        {
+            if (mExpect != EXP_VALUE || mNest.empty() || !isNumTailChar(c))
+            {
+                break;
+            }
+            mLex = LEX_WORD;
+            mTok.clear();
+            mTok.append(c);
+            return true;
+        }
+    }
+
+    std::string err;
+    format(err, "Unexpected '%c'", c);
+    setError(err.c_str());
+    return false;
+}
+
+void JsonPushParser::afterValue()
+{
+    mExpect = mNest.empty() ? EXP_DONE : EXP_NEXT;
+}
+
+bool JsonPushParser::handled(bool ok)
+{
+    if (!ok)
+    {
+        setError("Stopped by handler");
+    }
+    return ok;
+}
+
+void JsonPushParser::setError(const char* msg)
+{
+    if (!mErr)
+    {
+        format(mErrMsg, "Parser error: %s at line %d", msg, mLineNum);
+        mErr = true;
+
+        dbglog("Json parsing failed: %s\n", mErrMsg.c_str());
+    }
+}
+
+
+// JsonWriter::
+
+JsonWriter::JsonWriter(int fd, size_t bufsize /* = DEFAULT_BUFSIZE */) :
+    mFd(fd),
+    mFp(NULL),
+    mFunc(NULL),
+    mCtx(NULL),
+    mIndent(Variant::JSON_TABS),
+    mPool(NULL),
+    mBufSize((bufsize > 0) ? bufsize : 1),
+    mBuf(mBufSize + mBufSize / 4),
+    mFailed(false)
+{
+}
+
+JsonWriter::JsonWriter(FILE* fp, size_t bufsize /* = DEFAULT_BUFSIZE */) :
+    mFd(-1),
+    mFp(fp),
+    mFunc(NULL),
+    mCtx(NULL),
+    mIndent(Variant::JSON_TABS),
+    mPool(NULL),
+    mBufSize((bufsize > 0) ? bufsize : 1),
+    mBuf(mBufSize + mBufSize / 4),
+    mFailed(false)
+{
+}
+
+JsonWriter::JsonWriter(WriteFunc func, void* ctx, size_t bufsize /* = DEFAULT_BUFSIZE */) :
+    mFd(-1),
+    mFp(NULL),
+    mFunc(func),
+    mCtx(ctx),
+    mIndent(Variant::JSON_TABS),
+    mPool(NULL),
+    mBufSize((bufsize > 0) ? bufsize : 1),
+    mBuf(mBufSize + mBufSize / 4),
+    mFailed(false)
+{
+}
+
+JsonWriter::~JsonWriter()
+{
+    (void)flush();
+}
+
+bool JsonWriter::write(const Variant& var)
+{
+    if (mPool != NULL)
+    {
+        ((Variant&)var).makeJsonParallel(mBuf, mIndent, *mPool, this);
+    }
+    else
+    {
+        ((Variant&)var).makeString(mBuf, 0, true, mIndent, this);
+    }
+    checkFlush();
+    return !mFailed;
+}
+
+bool JsonWriter::writeRaw(const char* txt, size_t len)
+{
+    mBuf.append(txt, (int)len);
+    checkFlush();
+    return !mFailed;
+}
+
+bool JsonWriter::flush()
+{
+    if (mBuf.length() > 0)
+    {
+        if (!mFailed && !sinkWrite(mBuf.c_str(), mBuf.length()))
+        {
+            dbgerr("JsonWriter failed to write\n");
+            mFailed = true;
+        }
+
+        // After a failure the output is dropped.
+
+        mBuf.clear();
+    }
+
+    if (mFp != NULL && !mFailed && fflush(mFp) != 0)
+    {
+        mFailed = true;
+    }
+    return !mFailed;
+}
+
+bool JsonWriter::writeChunks(StrBld* bufs, int count)
+{
+    if (!flush())
+    {
+        return false;
+    }
+
+#ifndef _MSC_VER
+    if (mFd >= 0)
+    {
+        // One system call for as many buffers as writev() takes, then continue after
+        // what was written.
+
+        struct iovec iov[64];
+        int next = 0;
+        size_t skip = 0;
+
+        while (next < count)
+        {
+            int n = 0;
+            for (int i = next; i < count && n < (int)countof(iov); i++)
+            {
+                iov[n].iov_base = (void*)(bufs[i].c_str() + (i == next ? skip : 0));
+                iov[n].iov_len = bufs[i].length() - (i == next ? skip : 0);
+                n++;
+            }
+
+            ssize_t written = ::writev(mFd, iov, n);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                dbgerr("JsonWriter failed to write\n");
+                mFailed = true;
+                return false;
+            }
+
+            size_t left = (size_t)written;
+            while (next < count && left >= bufs[next].length() - skip)
+            {
+                left -= bufs[next].length() - skip;
+                skip = 0;
+                next++;
+            }
+            skip += left;
+        }
+        return true;
+    }
+#endif
+
+    for (int i = 0; i < count && !mFailed; i++)
+    {
+        if (!sinkWrite(bufs[i].c_str(), bufs[i].length()))
+        {
+            dbgerr("JsonWriter failed to write\n");
+            mFailed = true;
+        }
+    }
+    return !mFailed;
+}
+
+bool JsonWriter::sinkWrite(const char* data, size_t len)
+{
+    if (mFunc != NULL)
+    {
+        return mFunc(mCtx, data, len);
+    }
+    else if (mFp != NULL)
+    {
+        return fwrite(data, 1, len, mFp) == len;
+    }
+
+    while (len > 0)
+    {
+#ifdef _MSC_VER
+        int n = _write(mFd, data, (uint)len);
+#else
+        ssize_t n = ::write(mFd, data, len);
+#endif
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// JsonExtractor::
+
+static inline const char* skipSpace(const char* p, const char* end)
+{
+    while (p < end && isspace((uchar)*p))
+    {
+        p++;
+    }
+    return p;
+}
+
+static const char* skipScalar(const char* p, const char* end)
+{
+    // Numbers, true, false and null run up to a delimiter.
+
+    const char* start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && !isspace((uchar)*p))
+    {
+        p++;
+    }
+    return (p == start) ? NULL : p;
+}
+
+/**
+ * Unescapes the text between the quotes of a json string.  Returns false if it has an
+ * unknown escape or a \\u escape without 4 hex chars.
+ */
+static bool unescapeStr(const char* p, const char* end, std::string& out)
+{
+    out.clear();
+    while (p < end)
+    {
+        char c = *p++;
+        if (c != '\\')
+        {
+            out += c;
+            continue;
+        }
+        if (p == end)
+        {
+            return false;
+        }
+
+        char escch = *p++;
+        int pos;
+        if (strfind(ESCAPE_CODES, escch, &pos))
+        {
+            out += ESCAPE_CHARS[pos];
+        }
+        else if (escch == 'u')
+        {
+            uint cp;
+            int used;
+            if (!readEscapeHex(p, end - p, &cp, &used))
+            {
+                return false;
+            }
+            out += makeUTF8(cp);
+            p += used;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parses the json value at \p p into \p var.  Returns a pointer past it or NULL.
+ */
+static const char* parseValueAt(const char* p, const char* end, Variant& var)
+{
+    if (p >= end)
+    {
+        return NULL;
+    }
+
+    if (*p == '{' || *p == '[')
+    {
+        const char* e = skipValue(p, end, false);
+        if (e == NULL)
+        {
+            return NULL;
+        }
+        JsonParser json(var, p, e - p, 0);
+        return json.failed() ? NULL : e;
+    }
+    else if (*p == '"')
+    {
+        const char* e = skipQuoted(p + 1, end, '"');
+        if (e == NULL)
+        {
+            return NULL;
+        }
+        if (memchr(p + 1, '\\', e - p - 2) == NULL)
+        {
+            var = std::string(p + 1, e - p - 2);
+        }
+        else
+        {
+            std::string str;
+            if (!unescapeStr(p + 1, e - 1, str))
+            {
+                return NULL;
+            }
+            var = str;
+        }
+        return e;
+    }
+
+    const char* e = skipScalar(p, end);
+    if (e == NULL)
+    {
+        return NULL;
+    }
+
+    size_t len = e - p;
+    if (isDigitChar(*p) || *p == '-')
+    {
+        bool valid;
+        if (scanNum(p, e, var, valid) != e || !valid)
+        {
+            return NULL;
+        }
+    }
+    else if (len == 4 && memcmp(p, "true", 4) == 0)
+    {
+        var = true;
+    }
+    else if (len == 5 && memcmp(p, "false", 5) == 0)
+    {
+        var = false;
+    }
+    else if (len == 4 && memcmp(p, "null", 4) == 0)
+    {
+        var = VNULL;
+    }
+    else
+    {
+        return NULL;
+    }
+    return e;
+}
+
+JsonExtractor::JsonExtractor() :
+    mSegIndex(sizeof(int), NULL),
+    mPaths(sizeof(PathInfo), NULL),
+    mEnd(NULL),
+    mValues(NULL),
+    mMissing(0)
+{
+}
+
+int JsonExtractor::addPath(const char* path)
+{
+    int n = mPaths.length();
+    if (n >= MAXPATHS)
+    {
+        dbgerr("Too many paths\n");
+        return -1;
+    }
+
+    PathInfo info;
+    info.first = mSegs.length();
+    info.count = 0;
+
+    const char* p = path;
+    while (*p)
+    {
+        const char* delim = strstr(p, VAR_PATH_DELIM);
+        size_t len = delim ? (size_t)(delim - p) : strlen(p);
+
+        if (len > 0)
+        {
+            std::string seg(p, len);
+            bool valid;
+            int index = (int)str2int(seg, &valid);
+            if (!valid || index < 0)
+            {
+                index = -1;
+            }
+
+            mSegs.append(seg);
+            mSegIndex.append(&index);
+            info.count++;
+        }
+
+        p += len;
+        if (delim)
+        {
+            p += strlen(VAR_PATH_DELIM);
+        }
+    }
+
+    mPaths.append(&info);
+    return n;
+}
+
+void JsonExtractor::clearPaths()
+{
+    mSegs.clear();
+    mSegIndex.clear();
+    mPaths.clear();
+}
+
+bool JsonExtractor::extract(const char* jsontxt, size_t len, Variant& values)
+{
+    int count = mPaths.length();
+
+    values.createArray();
+    for (int i = 0; i < count; i++)
+    {
+        values.append(VNULL);
+    }
+
+    mEnd = jsontxt + len;
+    mValues = &values;
+    mMissing = (count == MAXPATHS) ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1);
+
+    const char* p = skipSpace(jsontxt, mEnd);
+    if (p == mEnd || (*p != '{' && *p != '['))
+    {
+        return false;
+    }
+    return scan(p, 0, mMissing) != NULL;
+}
+
+const char* JsonExtractor::scan(const char* p, int depth, uint64_t active)
+{
+    // Paths ending here take the whole value, others need to go deeper.
+
+    uint64_t ending = 0;
+    for (int i = 0; i < mPaths.length(); i++)
+    {
+        uint64_t bit = (uint64_t)1 << i;
+        if ((active & bit) && pathInfo(i)->count == depth)
+        {
+            ending |= bit;
+        }
+    }
+
+    if (ending)
+    {
+        Variant value;
+        p = parseValueAt(p, mEnd, value);
+        if (p == NULL)
+        {
+            return NULL;
+        }
+
+        for (int i = 0; i < mPaths.length(); i++)
+        {
+            if (active & ((uint64_t)1 << i))
+            {
+                setFound(i, value, depth);
+            }
+        }
+        return p;
+    }
+
+    if (p < mEnd && *p == '{')
+    {
+        return scanObject(p, depth, active);
+    }
+    else if (p < mEnd && *p == '[')
+    {
+        return scanArray(p, depth, active);
+    }
+    else if (p < mEnd && *p == '"')
+    {
+        return skipQuoted(p + 1, mEnd, '"');
+    }
+    return skipScalar(p, mEnd);
+}
+
+void JsonExtractor::setFound(int n, Variant& value, int depth)
+{
+    // Walk the rest of the path (if any) within the parsed value.
+
+    PathInfo* info = pathInfo(n);
+    Variant* v = &value;
+
+    for (int d = depth; d < info->count && v != NULL; d++)
+    {
+        const std::string* seg = mSegs.get(info->first + d);
+        int index = *(int*)mSegIndex.get(info->first + d);
+
+        if (v->isArray())
+        {
+            v = (index >= 0 && index < v->length()) ? &(*v)[index] : NULL;
+        }
+        else if (v->isObject() && v->hasProperty(seg->c_str()))
+        {
+            v = &(*v)[seg->c_str()];
+        }
+        else
+        {
+            v = NULL;
+        }
+    }
+
+    if (v != NULL)
+    {
+        (*mValues)[n] = *v;
+        mMissing &= ~((uint64_t)1 << n);
+    }
+}
+
+const char* JsonExtractor::scanObject(const char* p, int depth, uint64_t active)
+{
+    p = skipSpace(p + 1, mEnd);
+    if (p < mEnd && *p == '}')
+    {
+        return p + 1;
+    }
+
+    for (;;)
+    {
+        if (p >= mEnd || *p != '"')
+        {
+            return NULL;
+        }
+
+        const char* key = p + 1;
+        p = skipQuoted(key, mEnd, '"');
+        if (p == NULL)
+        {
+            return NULL;
+        }
+        size_t keylen = p - 1 - key;
+
+        std::string unescaped;
+        if (memchr(key, '\\', keylen) != NULL)
+        {
+            if (!unescapeStr(key, key + keylen, unescaped))
+            {
+                return NULL;
+            }
+            key = unescaped.c_str();
+            keylen = unescaped.length();
+        }
+
+        // Paths which continue with this key
+
+        uint64_t sub = 0;
+        for (int i = 0; i < mPaths.length(); i++)
+        {
+            uint64_t bit = (uint64_t)1 << i;
+            if ((active & mMissing & bit) == 0)
+            {
+                continue;
+            }
+
+            const std::string* seg = mSegs.get(pathInfo(i)->first + depth);
+            if (seg->length() == keylen && memcmp(seg->c_str(), key, keylen) == 0)
+            {
+                sub |= bit;
+            }
+        }
+
+        p = skipSpace(p, mEnd);
+        if (p >= mEnd || *p != ':')
+        {
+            return NULL;
+        }
+        p = skipSpace(p + 1, mEnd);
+
+        if (sub)
+        {
+            p = scan(p, depth + 1, sub);
+            if (p != NULL && mMissing == 0)
+            {
+                // Found everything, no need to look further
+
+                return p;
+            }
+        }
+        else
+        {
+            p = (p < mEnd && (*p == '{' || *p == '[')) ? skipValue(p, mEnd, false) : scan(p, depth + 1, 0);
+        }
+        if (p == NULL)
+        {
+            return NULL;
+        }
+
+        p = skipSpace(p, mEnd);
+        if (p < mEnd && *p == ',')
+        {
+            p = skipSpace(p + 1, mEnd);
+        }
+        else if (p < mEnd && *p == '}')
+        {
+            return p + 1;
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+}
+
+const char* JsonExtractor::scanArray(const char* p, int depth, uint64_t active)
+{
+    p = skipSpace(p + 1, mEnd);
+    if (p < mEnd && *p == ']')
+    {
+        return p + 1;
+    }
+
+    for (int n = 0; ; n++)
+    {
+        // Paths which continue with this index
+
+        uint64_t sub = 0;
+        for (int i = 0; i < mPaths.length(); i++)
+        {
+            uint64_t bit = (uint64_t)1 << i;
+            if ((active & mMissing & bit) != 0 && *(int*)mSegIndex.get(pathInfo(i)->first + depth) == n)
+            {
+                sub |= bit;
+            }
+        }
+
+        if (sub)
+        {
+            p = scan(p, depth + 1, sub);
+            if (p != NULL && mMissing == 0)
+            {
+                return p;
+            }
+        }
+        else
+        {
+            p = (p < mEnd && (*p == '{' || *p == '[')) ? skipValue(p, mEnd, false) : scan(p, depth + 1, 0);
+        }
+        if (p == NULL)
+        {
+            return NULL;
+        }
+
+        p = skipSpace(p, mEnd);
+        if (p < mEnd && *p == ',')
+        {
+            p = skipSpace(p + 1, mEnd);
+        }
+        else if (p < mEnd && *p == ']')
+        {
+            return p + 1;
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+}
+
+// NdjsonReader::
+
+enum
+{
+    // Lines parsed per task, tasks are sized so each thread gets several of them
+
+    NDJSON_TASKLINES = 256,
+    NDJSON_TASKSPERTHREAD = 4
+};
+
+NdjsonReader::NdjsonReader(int numthreads /*= 0*/) :
+    mPool(numthreads),
+    mTxt(NULL),
+    mLen(0),
+    mPos(0),
+    mErrors(0),
+    mLines(sizeof(Line), NULL),
+    mNextRec(0),
+    mTaskLines(NDJSON_TASKLINES),
+    mFunc(NULL),
+    mFuncCtx(NULL),
+    mStop(0)
+{
+}
+
+bool NdjsonReader::readFile(const char* filename)
+{
+    setText(NULL, 0);
+    if (!mFile.open(filename))
+    {
+        return false;
+    }
+    setText(mFile.data(), mFile.size());
+    return true;
+}
+
+void NdjsonReader::setText(const char* txt, size_t len)
+{
+    mTxt = txt;
+    mLen = len;
+    mPos = 0;
+    mErrors = 0;
+    mLines.clear();
+    mRecs.clear();
+    mNextRec = 0;
+}
+
+int NdjsonReader::splitLines()
+{
+    // Split the next batch of non-blank lines off the text
+
+    int maxlines = mPool.threadCount() * NDJSON_TASKSPERTHREAD * mTaskLines;
+
+    mLines.clear();
+    while (mPos < mLen && mLines.length() < maxlines)
+    {
+        const char* start = mTxt + mPos;
+        const char* nl = (const char*)memchr(start, '\n', mLen - mPos);
+        size_t len = nl ? (size_t)(nl - start) : mLen - mPos;
+
+        mPos += len + 1;
+
+        size_t i = 0;
+        while (i < len && isspace((uchar)start[i]))
+        {
+            i++;
+        }
+        if (i < len)
+        {
+            Line line;
+            line.txt = start;
+            line.len = len;
+            mLines.append(&line);
+        }
+    }
+    if (mPos > mLen)
+    {
+        mPos = mLen;
+    }
+    return mLines.length();
+}
+
+bool NdjsonReader::parseLine(const Line& line, Variant& rec)
+{
+    JsonParser json(rec, line.txt, line.len, 0);
+    if (json.failed())
+    {
+        rec.clear();
+        return false;
+    }
+    return true;
+}
+
+void NdjsonReader::parseTask(void* ctx, int index)
+{
+    NdjsonReader* self = (NdjsonReader*)ctx;
+
+    int first = index * self->mTaskLines;
+    int last = first + self->mTaskLines;
+    if (last > self->mLines.length())
+    {
+        last = self->mLines.length();
+    }
+
+    for (int i = first; i < last; i++)
+    {
+        parseLine(*(Line*)self->mLines.get(i), *self->mRecs.get(i));
+    }
+}
+
+bool NdjsonReader::next(Variant& rec)
+{
+    for (;;)
+    {
+        while (mNextRec < mRecs.length())
+        {
+            Variant* r = mRecs.get(mNextRec++);
+            if (r->isEmpty())
+            {
+                mErrors++;
+                continue;
+            }
+
+            // The record owns its memory, it is handed over without copying it.
+
+            rec.moveFrom(*r);
+            return true;
+        }
+
+        // Parse the next batch in parallel
+
+        int count = splitLines();
+        if (count == 0)
+        {
+            return false;
+        }
+
+        mRecs.clear();
+        for (int i = 0; i < count; i++)
+        {
+            mRecs.append();
+        }
+        mNextRec = 0;
+
+        mPool.run(parseTask, this, (count + mTaskLines - 1) / mTaskLines);
+    }
+}
+
+void NdjsonReader::forEachTask(void* ctx, int index)
+{
+    NdjsonReader* self = (NdjsonReader*)ctx;
+    size_t* errors = (size_t*)self->mTaskErrors.ptr() + index;
+
+    int first = index * self->mTaskLines;
+    int last = first + self->mTaskLines;
+    if (last > self->mLines.length())
+    {
+        last = self->mLines.length();
+    }
+
+    Variant rec;
+    for (int i = first; i < last && !atomicGet(&self->mStop); i++)
+    {
+        if (!parseLine(*(Line*)self->mLines.get(i), rec))
+        {
+            (*errors)++;
+        }
+        else if (!self->mFunc(rec, self->mFuncCtx))
+        {
+            atomicSet(&self->mStop, 1);
+        }
+    }
+}
+
+bool NdjsonReader::forEach(RecordFunc func, void* ctx)
+{
+    // Records already parsed by next() go first
+
+    mStop = 0;
+    while (mNextRec < mRecs.length())
+    {
+        Variant* r = mRecs.get(mNextRec++);
+        if (r->isEmpty())
+        {
+            mErrors++;
+        }
+        else if (!func(*r, ctx))
+        {
+            return false;
+        }
+    }
+
+    mFunc = func;
+    mFuncCtx = ctx;
+
+    int count;
+    while (!mStop && (count = splitLines()) > 0)
+    {
+        int tasks = (count + mTaskLines - 1) / mTaskLines;
+
+        mTaskErrors.alloc(tasks * sizeof(size_t));
+        mTaskErrors.zero();
+
+        mPool.run(forEachTask, this, tasks);
+
+        for (int i = 0; i < tasks; i++)
+        {
+            mErrors += ((size_t*)mTaskErrors.ptr())[i];
+        }
+    }
+    return !mStop;
+}
+
 } // jvar
\ No newline at end of file
@@ -0,0 +1,425 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "msgpack.h"
+#include <stdint.h>
+#include <limits.h>
+
+namespace jvar
+{
+
+// Type bytes
+
+enum
+{
+    MP_POSFIXINT = 0x00,
+    MP_FIXMAP = 0x80,
+    MP_FIXARRAY = 0x90,
+    MP_FIXSTR = 0xa0,
+    MP_NIL = 0xc0,
+    MP_FALSE = 0xc2,
+    MP_TRUE = 0xc3,
+    MP_BIN8 = 0xc4,
+    MP_BIN16 = 0xc5,
+    MP_BIN32 = 0xc6,
+    MP_FLOAT32 = 0xca,
+    MP_FLOAT64 = 0xcb,
+    MP_UINT8 = 0xcc,
+    MP_UINT16 = 0xcd,
+    MP_UINT32 = 0xce,
+    MP_UINT64 = 0xcf,
+    MP_INT8 = 0xd0,
+    MP_INT16 = 0xd1,
+    MP_INT32 = 0xd2,
+    MP_INT64 = 0xd3,
+    MP_STR8 = 0xd9,
+    MP_STR16 = 0xda,
+    MP_STR32 = 0xdb,
+    MP_ARRAY16 = 0xdc,
+    MP_ARRAY32 = 0xdd,
+    MP_MAP16 = 0xde,
+    MP_MAP32 = 0xdf,
+    MP_NEGFIXINT = 0xe0
+};
+
+static inline void putBE(StrBld& out, uchar type, uint64_t v, int bytes)
+{
+    // Type byte followed by the value in big endian
+
+    char buf[9];
+    buf[0] = (char)type;
+    for (int i = bytes; i > 0; i--)
+    {
+        buf[i] = (char)(v & 0xff);
+        v >>= 8;
+    }
+    out.append(buf, bytes + 1);
+}
+
+static inline uint64_t getBE(const uchar* p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline void putHeader(StrBld& out, size_t n, uchar fixtype, size_t fixmax, uchar type16)
+{
+    // Headers of strings, arrays and maps: a fix type or 16/32-bit length after type16.
+    // The 8-bit length form (strings only) is handled by the caller.
+
+    if (n <= fixmax)
+    {
+        out.append((char)(fixtype | n));
+    }
+    else if (n <= 0xffff)
+    {
+        putBE(out, type16, n, 2);
+    }
+    else
+    {
+        putBE(out, (uchar)(type16 + 1), n, 4);
+    }
+}
+
+void MsgPack::encode(const Variant& var, StrBld& out)
+{
+    encodeValue((Variant&)var, out);
+}
+
+void MsgPack::encodeInt(longint n, StrBld& out)
+{
+    if (n >= 0)
+    {
+        if (n < 0x80)
+        {
+            out.append((char)n);
+        }
+        else if (n <= 0xff)
+        {
+            putBE(out, MP_UINT8, n, 1);
+        }
+        else if (n <= 0xffff)
+        {
+            putBE(out, MP_UINT16, n, 2);
+        }
+        else if (n <= 0xffffffffL)
+        {
+            putBE(out, MP_UINT32, n, 4);
+        }
+        else
+        {
+            putBE(out, MP_UINT64, n, 8);
+        }
+    }
+    else
+    {
+        if (n >= -32)
+        {
+            out.append((char)n);
+        }
+        else if (n >= -0x80)
+        {
+            putBE(out, MP_INT8, (uint64_t)n, 1);
+        }
+        else if (n >= -0x8000)
+        {
+            putBE(out, MP_INT16, (uint64_t)n, 2);
+        }
+        else if (n >= -0x80000000L)
+        {
+            putBE(out, MP_INT32, (uint64_t)n, 4);
+        }
+        else
+        {
+            putBE(out, MP_INT64, (uint64_t)n, 8);
+        }
+    }
+}
+
+void MsgPack::encodeStr(const char* s, size_t len, StrBld& out)
+{
+    if (len >= 32 && len <= 0xff)
+    {
+        putBE(out, MP_STR8, len, 1);
+    }
+    else
+    {
+        putHeader(out, len, MP_FIXSTR, 31, MP_STR16);
+    }
+    out.append(s, (int)len);
+}
+
+void MsgPack::encodeValue(Variant& var, StrBld& out)
+{
+    var.ensureLoaded();
+
+    Variant::VarData& data = var.mData;
+    switch (data.type)
+    {
+        case Variant::V_INT:
+        {
+            encodeInt(data.intData, out);
+        }
+        break;
+
+        case Variant::V_DOUBLE:
+        {
+            uint64_t bits;
+            memcpy(&bits, &data.dblData, sizeof(bits));
+            putBE(out, MP_FLOAT64, bits, 8);
+        }
+        break;
+
+        case Variant::V_BOOL:
+        {
+            out.append((char)(data.boolData ? MP_TRUE : MP_FALSE));
+        }
+        break;
+
+        case Variant::V_STRING:
+        {
+            const char* s = data.strPtr();
+            encodeStr(s, data.strLen(), out);
+        }
+        break;
+
+        case Variant::V_ARRAY:
+        {
+            int n = data.arrayData->length();
+            putHeader(out, n, MP_FIXARRAY, 15, MP_ARRAY16);
+            for (int i = 0; i < n; i++)
+            {
+                encodeValue(*data.arrayData->get(i), out);
+            }
+        }
+        break;
+
+        case Variant::V_OBJECT:
+        {
+            int n = data.objectData->length();
+            putHeader(out, n, MP_FIXMAP, 15, MP_MAP16);
+            for (int i = 0; i < n; i++)
+            {
+                const char* key = data.objectData->getKey(i);
+                encodeStr(key, strlen(key), out);
+                encodeValue(*data.objectData->get(i), out);
+            }
+        }
+        break;
+
+        case Variant::V_POINTER:
+        {
+            if (data.vptrData != NULL)
+            {
+                encodeValue(*data.vptrData, out);
+            }
+            else
+            {
+                out.append((char)MP_NIL);
+            }
+        }
+        break;
+
+        default:
+        {
+            // Null, empty and functions
+
+            out.append((char)MP_NIL);
+        }
+    }
+}
+
+bool MsgPack::decode(Variant& var, const char* data, size_t len, size_t* used /* = NULL */)
+{
+    const uchar* start = (const uchar*)data;
+    const uchar* end = start + len;
+
+    const uchar* p = decodeValue(var, start, end, 0);
+    if (p == NULL || (used == NULL && p != end))
+    {
+        dbglog("MsgPack decoding failed\n");
+        var.clear();
+        return false;
+    }
+
+    if (used != NULL)
+    {
+        *used = p - start;
+    }
+    return true;
+}
+
+const uchar* MsgPack::decodeValue(Variant& var, const uchar* p, const uchar* end, int depth)
+{
+    if (p >= end || depth > MAXDEPTH)
+    {
+        return NULL;
+    }
+
+    uchar type = *p++;
+    size_t avail = end - p;
+
+    // Sizes of the type's fixed part and of its length/count (for strings, arrays, maps)
+
+    int size = 0;
+    int lensize = 0;
+
+    switch (type)
+    {
+        case MP_FLOAT32: case MP_UINT32: case MP_INT32: size = 4; break;
+        case MP_FLOAT64: case MP_UINT64: case MP_INT64: size = 8; break;
+        case MP_UINT8: case MP_INT8: size = 1; break;
+        case MP_UINT16: case MP_INT16: size = 2; break;
+        case MP_STR8: case MP_BIN8: lensize = 1; break;
+        case MP_STR16: case MP_BIN16: case MP_ARRAY16: case MP_MAP16: lensize = 2; break;
+        case MP_STR32: case MP_BIN32: case MP_ARRAY32: case MP_MAP32: lensize = 4; break;
+    }
+    if (avail < (size_t)(size + lensize))
+    {
+        return NULL;
+    }
+
+    uint64_t v = getBE(p, size + lensize);
+    p += size + lensize;
+
+    size_t count = 0;
+    char kind = 0;
+
+    if (type < MP_FIXMAP)
+    {
+        var = (longint)type;
+        return p;
+    }
+    else if (type >= MP_NEGFIXINT)
+    {
+        var = (longint)(signed char)type;
+        return p;
+    }
+    else if (type < MP_FIXARRAY)
+    {
+        kind = 'm';
+        count = type & 0x0f;
+    }
+    else if (type < MP_FIXSTR)
+    {
+        kind = 'a';
+        count = type & 0x0f;
+    }
+    else if (type < MP_NIL)
+    {
+        kind = 's';
+        count = type & 0x1f;
+    }
+    else
+    {
+        switch (type)
+        {
+            case MP_NIL: var = VNULL; return p;
+            case MP_FALSE: var = false; return p;
+            case MP_TRUE: var = true; return p;
+
+            case MP_UINT8: case MP_UINT16: case MP_UINT32: case MP_UINT64:
+            {
+                if (v > (uint64_t)LONG_MAX)
+                {
+                    var = (double)v;
+                }
+                else
+                {
+                    var = (longint)v;
+                }
+                return p;
+            }
+
+            case MP_INT8: var = (longint)(int8_t)v; return p;
+            case MP_INT16: var = (longint)(int16_t)v; return p;
+            case MP_INT32: var = (longint)(int32_t)v; return p;
+            case MP_INT64: var = (longint)(int64_t)v; return p;
+
+            case MP_FLOAT32:
+            {
+                uint32_t bits = (uint32_t)v;
+                float f;
+                memcpy(&f, &bits, sizeof(f));
+                var = (double)f;
+                return p;
+            }
+
+            case MP_FLOAT64:
+            {
+                double d;
+                memcpy(&d, &v, sizeof(d));
+                var = d;
+                return p;
+            }
+
+            case MP_STR8: case MP_STR16: case MP_STR32:
+            case MP_BIN8: case MP_BIN16: case MP_BIN32:
+                kind = 's';
+                count = (size_t)v;
+                break;
+
+            case MP_ARRAY16: case MP_ARRAY32:
+                kind = 'a';
+                count = (size_t)v;
+                break;
+
+            case MP_MAP16: case MP_MAP32:
+                kind = 'm';
+                count = (size_t)v;
+                break;
+
+            default:
+                dbglog("MsgPack type 0x%x not supported\n", type);
+                return NULL;
+        }
+    }
+
+    // Every element takes at least a byte, so a bad count is caught before reserving.
+    // Arrays and maps can't have more elements than an int holds.
+
+    avail = end - p;
+    if (count > avail || (kind == 'm' && count > avail / 2) || (kind != 's' && count > INT_MAX))
+    {
+        return NULL;
+    }
+
+    if (kind == 's')
+    {
+        var.internalAssignStr((const char*)p, count);
+        return p + count;
+    }
+    else if (kind == 'a')
+    {
+        var.createArray();
+        var.reserve((int)count);
+        for (size_t i = 0; i < count && p != NULL; i++)
+        {
+            p = decodeValue(*var.append(VEMPTY), p, end, depth + 1);
+        }
+        return p;
+    }
+
+    var.createObject();
+    var.reserve((int)count);
+
+    Variant key;
+    for (size_t i = 0; i < count && p != NULL; i++)
+    {
+        p = decodeValue(key, p, end, depth + 1);
+        if (p == NULL || key.isArray() || key.isObject())
+        {
+            return NULL;
+        }
+
+        Variant& prop = var.addOrModifyProperty(key.isString() ? key.c_str() : key.toString().c_str());
+        p = decodeValue(prop, p, end, depth + 1);
+    }
+    return p;
+}
+
+} // jvar
@@ -0,0 +1,675 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "snapshot.h"
+
+namespace jvar
+{
+
+// File layout:
+//
+//   header   "JVARSNAP", uint32 version, uint32 byte order mark
+//   data     strings, element arrays and object blocks, each aligned to 8 bytes
+//   trailer  root SnapValue, uint64 file size, "JVARSNAP"
+//
+// Children are written before their parents, so the output is streamed in one pass and
+// the root comes last.  An object block is its values in original order, an int64 key
+// offset per value (relative to the block), then a uint32 index of the value positions
+// in sorted key order, padded to 8 bytes.
+
+static const char SNAP_MAGIC[8] = { 'J', 'V', 'A', 'R', 'S', 'N', 'A', 'P' };
+static const uint SNAP_BOM = 0x01020304;
+
+enum
+{
+    SNAP_HEADSIZE = 16,
+    SNAP_TRAILSIZE = 32
+};
+
+const SnapValue SnapValue::sNull;
+
+SnapValue::SnapValue() :
+    mType((uchar)Variant::V_NULL),
+    mFlags(0),
+    mReserved(0),
+    mLen(0),
+    mData(0)
+{
+}
+
+longint SnapValue::toInt() const
+{
+    switch (mType)
+    {
+        case Variant::V_INT:
+        case Variant::V_BOOL:
+            return (longint)mData;
+
+        case Variant::V_DOUBLE:
+            return (longint)toDouble();
+
+        case Variant::V_STRING:
+        {
+            char* end;
+            errno = 0;
+            long int value = strtol(c_str(), &end, 10);
+            if ((errno != 0 && value == 0) || (*end != '\0'))
+            {
+                value = 0;
+            }
+            return value;
+        }
+
+        default:
+            return 0;
+    }
+}
+
+double SnapValue::toDouble() const
+{
+    switch (mType)
+    {
+        case Variant::V_INT:
+        case Variant::V_BOOL:
+            return (double)mData;
+
+        case Variant::V_DOUBLE:
+        {
+            double d;
+            memcpy(&d, &mData, sizeof(d));
+            return d;
+        }
+
+        case Variant::V_STRING:
+        {
+            char* end;
+            double value = strtod(c_str(), &end);
+            if (*end != '\0')
+            {
+                value = 0.0;
+            }
+            return value;
+        }
+
+        default:
+            return 0.0;
+    }
+}
+
+bool SnapValue::toBool() const
+{
+    return toInt() != 0;
+}
+
+const char* SnapValue::c_str() const
+{
+    if (mType != Variant::V_STRING)
+    {
+        return NULL;
+    }
+    return isFlagSet(mFlags, SF_INLINE) ? (const char*)&mData : target();
+}
+
+const char* SnapValue::key(int pos) const
+{
+    const SnapValue* vals = (const SnapValue*)target();
+    const int64_t* keys = (const int64_t*)(vals + mLen);
+    return (const char*)vals + keys[pos];
+}
+
+const SnapValue& SnapValue::operator[](int i) const
+{
+    if (mType == Variant::V_ARRAY || mType == Variant::V_OBJECT)
+    {
+        if (i >= 0 && (uint)i < mLen)
+        {
+            return ((const SnapValue*)target())[i];
+        }
+    }
+    else if (!empty())
+    {
+        dbgerr("[%d] failed--not an object or array\n", i);
+    }
+    return sNull;
+}
+
+const SnapValue& SnapValue::operator[](const char* key) const
+{
+    assert(key);
+
+    return find(key, strlen(key));
+}
+
+const SnapValue& SnapValue::find(const char* key, size_t keylen) const
+{
+    if (mType != Variant::V_OBJECT)
+    {
+        if (!empty())
+        {
+            dbglog("[%.*s] failed--not an object\n", (int)keylen, key);
+        }
+        return sNull;
+    }
+
+    const SnapValue* vals = (const SnapValue*)target();
+    const uint* index = (const uint*)((const int64_t*)(vals + mLen) + mLen);
+    bool ci = isFlagSet(mFlags, SF_CASEINS);
+
+    // Binary search over the keys in sorted order.  The key isn't null terminated when
+    // it comes from a path, so a stored key which is longer compares as greater.
+
+    int low = 0;
+    int high = (int)mLen - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        const char* k = this->key(index[mid]);
+
+        int res = ci ? strncasecmp(k, key, keylen) : strncmp(k, key, keylen);
+        if (res == 0 && k[keylen] != '\0')
+        {
+            res = 1;
+        }
+
+        if (res == 0)
+        {
+            return vals[index[mid]];
+        }
+        else if (res < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return sNull;
+}
+
+const SnapValue& SnapValue::path(const char* pathkey) const
+{
+    assert(pathkey);
+
+    const SnapValue* v = this;
+
+    const char* s = pathkey;
+    while (*s != '\0')
+    {
+        const char* delim = strchr(s, VAR_PATH_DELIM[0]);
+        size_t len = delim ? (size_t)(delim - s) : strlen(s);
+
+        if (len > 0)
+        {
+            if (v->isArray())
+            {
+                // Only plain indexes, too many digits can't be a valid index either
+
+                int n = 0;
+                for (size_t i = 0; i < len; i++)
+                {
+                    if (s[i] < '0' || s[i] > '9' || i >= 9)
+                    {
+                        return sNull;
+                    }
+                    n = n * 10 + (s[i] - '0');
+                }
+                v = &((*v)[n]);
+            }
+            else
+            {
+                v = &v->find(s, len);
+            }
+        }
+
+        s += len;
+        if (*s != '\0')
+        {
+            s++;
+        }
+    }
+    return *v;
+}
+
+bool SnapValue::forEach(Iter<const SnapValue>& iter) const
+{
+    if (mType == Variant::V_ARRAY || mType == Variant::V_OBJECT)
+    {
+        iter.mPos++;
+        if ((uint)iter.mPos < mLen)
+        {
+            iter.mObj = (const SnapValue*)target() + iter.mPos;
+            iter.mKey = (mType == Variant::V_OBJECT) ? key(iter.mPos) : NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SnapValue::forEachSort(Iter<const SnapValue>& iter) const
+{
+    if (mType == Variant::V_OBJECT)
+    {
+        iter.mPos++;
+        if ((uint)iter.mPos < mLen)
+        {
+            const SnapValue* vals = (const SnapValue*)target();
+            const uint* index = (const uint*)((const int64_t*)(vals + mLen) + mLen);
+
+            int pos = index[iter.mPos];
+            iter.mObj = vals + pos;
+            iter.mKey = key(pos);
+            return true;
+        }
+    }
+    return false;
+}
+
+void SnapValue::copyTo(Variant& var) const
+{
+    switch (mType)
+    {
+        case Variant::V_INT:
+            var = (longint)mData;
+            break;
+
+        case Variant::V_DOUBLE:
+            var = toDouble();
+            break;
+
+        case Variant::V_BOOL:
+            var = (mData != 0);
+            break;
+
+        case Variant::V_STRING:
+            var.internalAssignStr(c_str(), mLen);
+            break;
+
+        case Variant::V_ARRAY:
+        {
+            var.createArray();
+            var.reserve((int)mLen);
+
+            const SnapValue* vals = (const SnapValue*)target();
+            for (uint i = 0; i < mLen; i++)
+            {
+                vals[i].copyTo(*var.append(VEMPTY));
+            }
+        }
+        break;
+
+        case Variant::V_OBJECT:
+        {
+            var.createObject();
+            if (isFlagSet(mFlags, SF_CASEINS))
+            {
+                var.makeCI();
+            }
+            var.reserve((int)mLen);
+
+            const SnapValue* vals = (const SnapValue*)target();
+            for (uint i = 0; i < mLen; i++)
+            {
+                vals[i].copyTo(var.addProperty(key(i)));
+            }
+        }
+        break;
+
+        default:
+            var = VNULL;
+    }
+}
+
+
+// Snapshot::
+
+/**
+ * Output state of Snapshot::write().  Keeps the offset of everything written and the
+ * offsets of the keys written so far, so repeated keys are only written once.
+ */
+struct Snapshot::Writer
+{
+    enum
+    {
+        KEYSLOTS = 128 * 1024,
+        MAXKEYS = KEYSLOTS / 2,     // Keys past this aren't shared, to bound the memory
+        MAXKEYLEN = 256
+    };
+
+    struct KeySlot
+    {
+        uint64_t offset;            // 0 when the slot is unused
+        uint hash;
+        uint txtpos;
+    };
+
+    Writer(FILE* f) :
+        fp(f),
+        pos(0),
+        failed(false),
+        numKeys(0),
+        keySlots(KEYSLOTS * sizeof(KeySlot))
+    {
+        keySlots.zero();
+    }
+
+    void put(const void* data, size_t len)
+    {
+        if (fwrite(data, 1, len, fp) != len)
+        {
+            failed = true;
+        }
+        pos += len;
+    }
+
+    void pad()
+    {
+        static const char zeros[8] = { 0 };
+        if ((pos & 7) != 0)
+        {
+            put(zeros, 8 - (size_t)(pos & 7));
+        }
+    }
+
+    uint64_t putStr(const char* s, size_t len)
+    {
+        uint64_t at = pos;
+        put(s, len);
+        put("", 1);
+        pad();
+        return at;
+    }
+
+    uint64_t putKey(const char* key)
+    {
+        size_t len = strlen(key);
+        if (len > MAXKEYLEN)
+        {
+            return putStr(key, len);
+        }
+
+        KeySlot* slots = (KeySlot*)keySlots.ptr();
+        uint hash = strHashSedgewick(key, len);
+        uint i = hash & (KEYSLOTS - 1);
+
+        while (slots[i].offset != 0)
+        {
+            if (slots[i].hash == hash && strcmp(keyTxt.c_str() + slots[i].txtpos, key) == 0)
+            {
+                return slots[i].offset;
+            }
+            i = (i + 1) & (KEYSLOTS - 1);
+        }
+
+        uint64_t at = putStr(key, len);
+        if (numKeys < MAXKEYS)
+        {
+            slots[i].offset = at;
+            slots[i].hash = hash;
+            slots[i].txtpos = (uint)keyTxt.length();
+            keyTxt.append(key, len + 1);
+            numKeys++;
+        }
+        return at;
+    }
+
+    void putRecords(SnapValue* recs, int n)
+    {
+        // Offsets of the records' data were kept from the start of the file until now,
+        // make them relative to the records.
+
+        for (int i = 0; i < n; i++)
+        {
+            SnapValue& rec = recs[i];
+            if (rec.mLen > 0 && (rec.mType == Variant::V_ARRAY || rec.mType == Variant::V_OBJECT ||
+                (rec.mType == Variant::V_STRING && isFlagClear(rec.mFlags, SnapValue::SF_INLINE))))
+            {
+                rec.mData -= (int64_t)(pos + i * sizeof(SnapValue));
+            }
+        }
+        put(recs, n * sizeof(SnapValue));
+    }
+
+    FILE* fp;
+    uint64_t pos;
+    bool failed;
+
+    int numKeys;
+    Buffer keySlots;
+    std::string keyTxt;
+};
+
+bool Snapshot::write(const Variant& var, FILE* fp)
+{
+    Writer w(fp);
+
+    char head[SNAP_HEADSIZE];
+    uint ver = VERSION;
+    memcpy(head, SNAP_MAGIC, 8);
+    memcpy(head + 8, &ver, 4);
+    memcpy(head + 12, &SNAP_BOM, 4);
+    w.put(head, sizeof(head));
+
+    SnapValue root;
+    writeValue(w, (Variant&)var, root);
+    w.putRecords(&root, 1);
+
+    uint64_t size = w.pos + 16;
+    w.put(&size, sizeof(size));
+    w.put(SNAP_MAGIC, 8);
+
+    return fflush(fp) == 0 && !w.failed;
+}
+
+void Snapshot::writeValue(Writer& w, Variant& var, SnapValue& rec)
+{
+    var.ensureLoaded();
+
+    Variant::VarData& data = var.mData;
+
+    rec.mType = (uchar)data.type;
+    rec.mFlags = 0;
+    rec.mReserved = 0;
+    rec.mLen = 0;
+    rec.mData = 0;
+
+    switch (data.type)
+    {
+        case Variant::V_INT:
+        {
+            rec.mData = data.intData;
+        }
+        break;
+
+        case Variant::V_DOUBLE:
+        {
+            memcpy(&rec.mData, &data.dblData, sizeof(rec.mData));
+        }
+        break;
+
+        case Variant::V_BOOL:
+        {
+            rec.mData = data.boolData ? 1 : 0;
+        }
+        break;
+
+        case Variant::V_STRING:
+        {
+            const char* s = data.strPtr();
+            size_t len = data.strLen();
+            if (len > 0xffffffffUL)
+            {
+                dbgerr("Snapshot can't store a string of %lu bytes\n", (ulongint)len);
+                w.failed = true;
+                rec.mType = Variant::V_NULL;
+                break;
+            }
+
+            rec.mLen = (uint)len;
+            if (len < sizeof(rec.mData))
+            {
+                setFlag(rec.mFlags, SnapValue::SF_INLINE);
+                memcpy(&rec.mData, s, len);
+            }
+            else
+            {
+                rec.mData = w.putStr(s, len);
+            }
+        }
+        break;
+
+        case Variant::V_ARRAY:
+        {
+            int n = data.arrayData->length();
+            rec.mLen = n;
+            if (n == 0)
+            {
+                break;
+            }
+
+            Buffer recbuf(n * sizeof(SnapValue));
+            SnapValue* recs = (SnapValue*)recbuf.ptr();
+            for (int i = 0; i < n; i++)
+            {
+                writeValue(w, *data.arrayData->get(i), recs[i]);
+            }
+
+            rec.mData = w.pos;
+            w.putRecords(recs, n);
+        }
+        break;
+
+        case Variant::V_OBJECT:
+        {
+            writeObject(w, *data.objectData, rec);
+        }
+        break;
+
+        case Variant::V_POINTER:
+        {
+            if (data.vptrData != NULL)
+            {
+                writeValue(w, *data.vptrData, rec);
+                break;
+            }
+            rec.mType = Variant::V_NULL;
+        }
+        break;
+
+        default:
+        {
+            // Null, empty and functions
+
+            rec.mType = Variant::V_NULL;
+        }
+    }
+}
+
+void Snapshot::writeObject(Writer& w, PropArray<Variant>& obj, SnapValue& rec)
+{
+    int n = obj.length();
+    rec.mLen = n;
+    if (obj.isCI())
+    {
+        setFlag(rec.mFlags, SnapValue::SF_CASEINS);
+    }
+    if (n == 0)
+    {
+        return;
+    }
+
+    Buffer recbuf(n * sizeof(SnapValue));
+    Buffer keybuf(n * sizeof(int64_t));
+    Buffer indexbuf(n * sizeof(uint));
+
+    SnapValue* recs = (SnapValue*)recbuf.ptr();
+    int64_t* keys = (int64_t*)keybuf.ptr();
+    uint* index = (uint*)indexbuf.ptr();
+
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = w.putKey(obj.getKey(i));
+        writeValue(w, *obj.get(i), recs[i]);
+        index[i] = obj.indexPos(i);
+    }
+
+    uint64_t block = w.pos;
+    rec.mData = block;
+    w.putRecords(recs, n);
+
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] -= (int64_t)block;
+    }
+    w.put(keys, n * sizeof(int64_t));
+    w.put(index, n * sizeof(uint));
+    w.pad();
+}
+
+bool Snapshot::open(const char* filename)
+{
+    close();
+
+    // Lookups jump around the file, so don't ask for read-ahead.
+
+    if (!mFile.open(filename, false))
+    {
+        return false;
+    }
+    if (!attach(mFile.data(), mFile.size()))
+    {
+        dbgerr("Not a valid snapshot file: %s\n", filename);
+        mFile.close();
+        return false;
+    }
+    return true;
+}
+
+bool Snapshot::attach(const void* data, size_t len)
+{
+    const char* p = (const char*)data;
+    mRoot = &SnapValue::sNull;
+
+    if (p == NULL || len < SNAP_HEADSIZE + SNAP_TRAILSIZE || (len & 7) != 0 || ((size_t)p & 7) != 0)
+    {
+        dbgerr("Snapshot is too small or not aligned\n");
+        return false;
+    }
+
+    uint ver;
+    uint bom;
+    uint64_t size;
+    memcpy(&ver, p + 8, 4);
+    memcpy(&bom, p + 12, 4);
+    memcpy(&size, p + len - 16, 8);
+
+    if (memcmp(p, SNAP_MAGIC, 8) != 0 || memcmp(p + len - 8, SNAP_MAGIC, 8) != 0 ||
+        bom != SNAP_BOM || ver != VERSION || size != len)
+    {
+        dbgerr("Snapshot header doesn't match (version %u)\n", ver);
+        return false;
+    }
+
+    const SnapValue* root = (const SnapValue*)(p + len - SNAP_TRAILSIZE);
+    if (root->mLen > 0 && (root->isArray() || root->isObject() ||
+        (root->isString() && isFlagClear(root->mFlags, SnapValue::SF_INLINE))))
+    {
+        int64_t at = (int64_t)(len - SNAP_TRAILSIZE) + root->mData;
+        if (at < SNAP_HEADSIZE || at >= (int64_t)(len - SNAP_TRAILSIZE))
+        {
+            dbgerr("Snapshot root is out of range\n");
+            return false;
+        }
+    }
+
+    mRoot = root;
+    return true;
+}
+
+void Snapshot::close()
+{
+    mFile.close();
+    mRoot = &SnapValue::sNull;
+}
+
+} // jvar
@@ -2,6 +2,22 @@
 // Released under the MIT License (http://opensource.org/licenses/MIT)
 
 #include "str.h"
+#include <stdint.h>
+#include <float.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CHARINDEX_SSE2
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CHARINDEX_AVX2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 using namespace std;
 
@@ -142,12 +158,63 @@ string formatr(const char* fmt, ...)
     return outstr;
 }
 
+static const char sDigitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+int int2buf(longint n, char* buf)
+{
+    // Digits are written backwards from the end of a scratch buffer, two at a time.
+    // The magnitude is unsigned so the most negative value works.
+
+    char tmp[INT2BUF_SIZE];
+    char* end = tmp + sizeof(tmp);
+    char* p = end;
+
+    ulongint u = (n < 0) ? 0 - (ulongint)n : (ulongint)n;
+
+    while (u >= 100)
+    {
+        uint pair = (uint)(u % 100) * 2;
+        u /= 100;
+        p -= 2;
+        p[0] = sDigitPairs[pair];
+        p[1] = sDigitPairs[pair + 1];
+    }
+    if (u >= 10)
+    {
+        uint pair = (uint)u * 2;
+        p -= 2;
+        p[0] = sDigitPairs[pair];
+        p[1] = sDigitPairs[pair + 1];
+    }
+    else
+    {
+        *--p = (char)('0' + u);
+    }
+    if (n < 0)
+    {
+        *--p = '-';
+    }
+
+    int len = (int)(end - p);
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return len;
+}
+
 string int2str(longint n)
 {
-    //TODO: call format() that returns a string
-    string s;
-    format(s, "%ld", n);
-    return s;
+    char buf[INT2BUF_SIZE];
+    return string(buf, int2buf(n, buf));
 }
 
 string dbl2str(double d)
@@ -157,6 +224,405 @@ string dbl2str(double d)
     return s;
 }
 
+// Double formatting uses Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers
+// Quickly and Accurately with Integers").  It finds the shortest (almost always) digits
+// which read back as the same double using 64-bit integer math only.
+
+namespace
+{
+
+struct DiyFp
+{
+    uint64_t f;
+    int e;
+
+    DiyFp(uint64_t fp, int exp) :
+        f(fp),
+        e(exp)
+    {
+    }
+
+    inline DiyFp operator-(const DiyFp& rhs) const
+    {
+        return DiyFp(f - rhs.f, e);
+    }
+
+    inline DiyFp operator*(const DiyFp& rhs) const
+    {
+        // 64x64 multiply keeping the rounded upper 64 bits.
+
+        const uint64_t M32 = 0xFFFFFFFF;
+        uint64_t a = f >> 32;
+        uint64_t b = f & M32;
+        uint64_t c = rhs.f >> 32;
+        uint64_t d = rhs.f & M32;
+        uint64_t ac = a * c;
+        uint64_t bc = b * c;
+        uint64_t ad = a * d;
+        uint64_t bd = b * d;
+        uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+        tmp += (uint64_t)1 << 31;
+        return DiyFp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), e + rhs.e + 64);
+    }
+
+    inline DiyFp normalize(int hiddenbit) const
+    {
+        DiyFp res = *this;
+        while ((res.f & ((uint64_t)1 << hiddenbit)) == 0)
+        {
+            res.f <<= 1;
+            res.e--;
+        }
+        res.f <<= 63 - hiddenbit;
+        res.e -= 63 - hiddenbit;
+        return res;
+    }
+};
+
+const int DBL_SIGBITS = 52;
+const int DBL_EXPBIAS = 0x3FF + DBL_SIGBITS;
+const uint64_t DBL_HIDDENBIT = (uint64_t)1 << DBL_SIGBITS;
+
+/**
+ * Normalized 64-bit significands and binary exponents of 10^-348, 10^-340, ... 10^340
+ */
+const uint64_t sCachedPowF[] =
+{
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+    0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+    0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+    0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+    0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+    0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+    0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+    0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+    0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+    0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+    0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+    0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+    0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+    0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+    0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+const short sCachedPowE[] =
+{
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+const uint sPow10Int[] =
+{
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+inline DiyFp dblToDiyFp(double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+
+    int biasede = (int)((bits >> DBL_SIGBITS) & 0x7FF);
+    uint64_t sig = bits & (DBL_HIDDENBIT - 1);
+
+    if (biasede != 0)
+    {
+        return DiyFp(sig + DBL_HIDDENBIT, biasede - DBL_EXPBIAS);
+    }
+    return DiyFp(sig, 1 - DBL_EXPBIAS);
+}
+
+inline DiyFp cachedPower(int e, int* k)
+{
+    // Pick a power of ten that brings the exponent into [-60, -32].
+
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    if (dk - ik > 0.0)
+    {
+        ik++;
+    }
+
+    uint index = (uint)((ik >> 3) + 1);
+    *k = -(-348 + (int)(index << 3));
+
+    return DiyFp(sCachedPowF[index], sCachedPowE[index]);
+}
+
+inline void grisuRound(char* buf, int len, uint64_t delta, uint64_t rest, uint64_t tenkappa, uint64_t wpw)
+{
+    while (rest < wpw && delta - rest >= tenkappa &&
+        (rest + tenkappa < wpw || wpw - rest > rest + tenkappa - wpw))
+    {
+        buf[len - 1]--;
+        rest += tenkappa;
+    }
+}
+
+inline int countDigits(uint n)
+{
+    int count = 1;
+    while (count < 10 && n >= sPow10Int[count])
+    {
+        count++;
+    }
+    return count;
+}
+
+void digitGen(const DiyFp& w, const DiyFp& mp, uint64_t delta, char* buf, int* len, int* k)
+{
+    const DiyFp one((uint64_t)1 << -mp.e, mp.e);
+    const DiyFp wpw = mp - w;
+    uint p1 = (uint)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = countDigits(p1);
+    *len = 0;
+
+    // Integral part
+
+    while (kappa > 0)
+    {
+        uint d = p1 / sPow10Int[kappa - 1];
+        p1 %= sPow10Int[kappa - 1];
+        if (d || *len)
+        {
+            buf[(*len)++] = (char)('0' + d);
+        }
+        kappa--;
+
+        uint64_t tmp = ((uint64_t)p1 << -one.e) + p2;
+        if (tmp <= delta)
+        {
+            *k += kappa;
+            grisuRound(buf, *len, delta, tmp, (uint64_t)sPow10Int[kappa] << -one.e, wpw.f);
+            return;
+        }
+    }
+
+    // Fractional part
+
+    for (;;)
+    {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d || *len)
+        {
+            buf[(*len)++] = (char)('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta)
+        {
+            *k += kappa;
+            int index = -kappa;
+            grisuRound(buf, *len, delta, p2, one.f, wpw.f * (index < 10 ? sPow10Int[index] : 0));
+            return;
+        }
+    }
+}
+
+/**
+ * Generates the digits of a positive, finite \p value into \p buf.  The value is the
+ * digits times 10^k.
+ */
+int grisu2(double value, char* buf, int* k)
+{
+    const DiyFp v = dblToDiyFp(value);
+
+    // Boundaries halfway to the neighboring doubles
+
+    DiyFp plus = DiyFp((v.f << 1) + 1, v.e - 1).normalize(DBL_SIGBITS + 1);
+    DiyFp minus = (v.f == DBL_HIDDENBIT) ? DiyFp((v.f << 2) - 1, v.e - 2) : DiyFp((v.f << 1) - 1, v.e - 1);
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    const DiyFp cmk = cachedPower(plus.e, k);
+    const DiyFp w = v.normalize(DBL_SIGBITS) * cmk;
+    DiyFp wp = plus * cmk;
+    DiyFp wm = minus * cmk;
+    wm.f++;
+    wp.f--;
+
+    int len;
+    digitGen(w, wp, wp.f - wm.f, buf, &len, k);
+    return len;
+}
+
+/**
+ * Writes nan, inf or a 0 for the values Grisu doesn't handle.  Returns the length or 0
+ * if \p d is a regular number.
+ */
+int specialDbl(double d, char* buf)
+{
+    const char* s = NULL;
+    if (d != d)
+    {
+        s = "nan";
+    }
+    else if (d == 0.0)
+    {
+        s = (1.0 / d < 0) ? "-0" : "0";
+    }
+    else if (d > DBL_MAX)
+    {
+        s = "inf";
+    }
+    else if (d < -DBL_MAX)
+    {
+        s = "-inf";
+    }
+
+    if (s == NULL)
+    {
+        return 0;
+    }
+    strcpy(buf, s);
+    return (int)strlen(s);
+}
+
+}
+
+int dbl2buf(double d, char* buf)
+{
+    int n = specialDbl(d, buf);
+    if (n > 0)
+    {
+        return n;
+    }
+
+    char* p = buf;
+    if (d < 0)
+    {
+        *p++ = '-';
+        d = -d;
+    }
+
+    int k;
+    int len = grisu2(d, p, &k);
+
+    // The decimal point goes after the first 'point' digits.  Like Javascript, use
+    // exponents only for very large or small values.
+
+    int point = len + k;
+
+    if (len <= point && point <= 21)
+    {
+        // 1234e3 -> 1234000
+
+        memset(p + len, '0', point - len);
+        p += point;
+    }
+    else if (0 < point && point <= 21)
+    {
+        // 1234e-2 -> 12.34
+
+        memmove(p + point + 1, p + point, len - point);
+        p[point] = '.';
+        p += len + 1;
+    }
+    else if (-6 < point && point <= 0)
+    {
+        // 1234e-6 -> 0.001234
+
+        int zeros = 2 - point;
+        memmove(p + zeros, p, len);
+        p[0] = '0';
+        p[1] = '.';
+        memset(p + 2, '0', zeros - 2);
+        p += len + zeros;
+    }
+    else
+    {
+        // 1234e30 -> 1.234e+33
+
+        if (len > 1)
+        {
+            memmove(p + 2, p + 1, len - 1);
+            p[1] = '.';
+            p += len + 1;
+        }
+        else
+        {
+            p++;
+        }
+
+        int exp = point - 1;
+        *p++ = 'e';
+        *p++ = (exp < 0) ? '-' : '+';
+        if (exp < 0)
+        {
+            exp = -exp;
+        }
+        if (exp >= 100)
+        {
+            *p++ = (char)('0' + exp / 100);
+        }
+        if (exp >= 10)
+        {
+            *p++ = (char)('0' + exp / 10 % 10);
+        }
+        *p++ = (char)('0' + exp % 10);
+    }
+
+    *p = '\0';
+    return (int)(p - buf);
+}
+
+std::string dbl2fixed(double d, int digs)
+{
+    if (digs < 0)
+    {
+        digs = 0;
+    }
+    else if (digs > 100)
+    {
+        digs = 100;
+    }
+
+    if (!(d > -1e21 && d < 1e21))
+    {
+        // Same as Javascript, large numbers, nan and inf are not fixed
+
+        char buf[DBL2BUF_SIZE];
+        dbl2buf(d, buf);
+        return std::string(buf);
+    }
+
+    // printf rounds the exact binary value, so 1.005 (1.00499999999999989...) gives 1.00.
+    // Up to 21 integral digits, the point and 100 digits fit.
+
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "%.*f", digs, d);
+    if (len < 0 || len >= (int)sizeof(buf))
+    {
+        return std::string();
+    }
+
+    // Use a '.' whatever the locale
+
+    for (int i = 0; i < len; i++)
+    {
+        if ((buf[i] < '0' || buf[i] > '9') && buf[i] != '-')
+        {
+            buf[i] = '.';
+        }
+    }
+    return std::string(buf, len);
+}
+
 longint str2baseint(const string& str, int base, bool* valid /* = NULL */)
 {
     char* end;
@@ -243,6 +709,49 @@ std::string makeUTF8(uint charcode)
     return s;
 }
 
+static bool readHex4(const char* s, uint* cp)
+{
+    uint v = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        char c = s[i];
+        if (c >= '0' && c <= '9')
+        {
+            v = v * 16 + (c - '0');
+        }
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+        {
+            v = v * 16 + ((c | 0x20) - 'a' + 10);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    *cp = v;
+    return true;
+}
+
+bool readEscapeHex(const char* s, size_t maxlen, uint* cp, int* lenused)
+{
+    *lenused = 4;
+    if (maxlen < 4 || !readHex4(s, cp))
+    {
+        return false;
+    }
+
+    // Characters above U+FFFF are escaped as a UTF-16 surrogate pair.  A lone surrogate is
+    // kept as is.
+
+    uint lo;
+    if (*cp >= 0xD800 && *cp < 0xDC00 && maxlen >= 10 && s[4] == '\\' && s[5] == 'u' &&
+        readHex4(s + 6, &lo) && lo >= 0xDC00 && lo < 0xE000)
+    {
+        *cp = 0x10000 + ((*cp - 0xD800) << 10) + (lo - 0xDC00);
+        *lenused = 10;
+    }
+    return true;
+}
 
 uint makeUnicode(const char* s, int maxlen, int* lenused /*= NULL*/)
 {
@@ -420,6 +929,408 @@ void StrBld::stripQuotes(bool allowsingle)
 }
 
 
+// CharIndex::
+
+enum
+{
+    CLS_SPACE = 0x1,
+    CLS_WORD = 0x2,
+    CLS_QUOTE = 0x4,
+    CLS_NEWLINE = 0x8
+};
+
+static uchar sCharClass[256];
+
+static bool initCharClass()
+{
+    // Same rules as isspace() and Parser::charWord() in the C locale.
+
+    for (int c = 0; c < 256; c++)
+    {
+        uchar cls = 0;
+
+        if (c == ' ' || (c >= '\t' && c <= '\r'))
+        {
+            cls |= CLS_SPACE;
+        }
+        if ((c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c == '_' || c == '\'')
+        {
+            cls |= CLS_WORD;
+        }
+        if (c == '"' || c == '\'' || c == '\\')
+        {
+            cls |= CLS_QUOTE;
+        }
+        if (c == '\n')
+        {
+            cls |= CLS_NEWLINE;
+        }
+        sCharClass[c] = cls;
+    }
+    return true;
+}
+
+static bool sCharClassInit = initCharClass();
+
+static inline int ctz64(uint64_t v)
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward64(&idx, v);
+    return (int)idx;
+#else
+    return __builtin_ctzll(v);
+#endif
+}
+
+static inline int popcount64(uint64_t v)
+{
+#ifdef _MSC_VER
+    return (int)__popcnt64(v);
+#else
+    return __builtin_popcountll(v);
+#endif
+}
+
+// Each classifier fills bit i of word 'w' in each of the maps (space, word, quote,
+// newline) for char i of a block of 64 chars.
+
+static void classifyScalar(const char* p, int len, uint64_t* bits, int stride, int w)
+{
+    uint64_t space = 0;
+    uint64_t word = 0;
+    uint64_t quote = 0;
+    uint64_t newline = 0;
+
+    for (int i = 0; i < len; i++)
+    {
+        uint cls = sCharClass[(uchar)p[i]];
+        uint64_t bit = (uint64_t)1 << i;
+
+        if (cls & CLS_SPACE)
+        {
+            space |= bit;
+        }
+        if (cls & CLS_WORD)
+        {
+            word |= bit;
+        }
+        if (cls & CLS_QUOTE)
+        {
+            quote |= bit;
+        }
+        if (cls & CLS_NEWLINE)
+        {
+            newline |= bit;
+        }
+    }
+
+    bits[w] = space;
+    bits[stride + w] = word;
+    bits[stride * 2 + w] = quote;
+    bits[stride * 3 + w] = newline;
+}
+
+#ifdef CHARINDEX_SSE2
+
+static void classifySse2(const char* p, int len, uint64_t* bits, int stride, int w)
+{
+    // Note: Compares are signed so chars >= 0x80 are never in any of the ranges.
+
+    uint64_t space = 0;
+    uint64_t word = 0;
+    uint64_t quote = 0;
+    uint64_t newline = 0;
+
+    for (int i = 0; i < 64; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+
+        __m128i sp = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+            _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('\t' - 1)),
+                _mm_cmplt_epi8(x, _mm_set1_epi8('\r' + 1))));
+
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+        __m128i squote = _mm_cmpeq_epi8(x, _mm_set1_epi8('\''));
+        __m128i wd = _mm_or_si128(_mm_or_si128(digit, alpha),
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('_')), squote));
+
+        __m128i qt = _mm_or_si128(squote, _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+            _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))));
+
+        __m128i nl = _mm_cmpeq_epi8(x, _mm_set1_epi8('\n'));
+
+        space |= (uint64_t)(uint)_mm_movemask_epi8(sp) << i;
+        word |= (uint64_t)(uint)_mm_movemask_epi8(wd) << i;
+        quote |= (uint64_t)(uint)_mm_movemask_epi8(qt) << i;
+        newline |= (uint64_t)(uint)_mm_movemask_epi8(nl) << i;
+    }
+
+    bits[w] = space;
+    bits[stride + w] = word;
+    bits[stride * 2 + w] = quote;
+    bits[stride * 3 + w] = newline;
+}
+
+#endif
+
+#ifdef CHARINDEX_AVX2
+
+__attribute__((target("avx2")))
+static void classifyAvx2(const char* p, int len, uint64_t* bits, int stride, int w)
+{
+    uint64_t space = 0;
+    uint64_t word = 0;
+    uint64_t quote = 0;
+    uint64_t newline = 0;
+
+    for (int i = 0; i < 64; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+
+        __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+            _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('\t' - 1)),
+                _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), x)));
+
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('0' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), x));
+        __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+        __m256i squote = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\''));
+        __m256i wd = _mm256_or_si256(_mm256_or_si256(digit, alpha),
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')), squote));
+
+        __m256i qt = _mm256_or_si256(squote, _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+            _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))));
+
+        __m256i nl = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n'));
+
+        space |= (uint64_t)(uint)_mm256_movemask_epi8(sp) << i;
+        word |= (uint64_t)(uint)_mm256_movemask_epi8(wd) << i;
+        quote |= (uint64_t)(uint)_mm256_movemask_epi8(qt) << i;
+        newline |= (uint64_t)(uint)_mm256_movemask_epi8(nl) << i;
+    }
+
+    bits[w] = space;
+    bits[stride + w] = word;
+    bits[stride * 2 + w] = quote;
+    bits[stride * 3 + w] = newline;
+}
+
+#endif
+
+typedef void (*ClassifyFunc)(const char* p, int len, uint64_t* bits, int stride, int w);
+
+static ClassifyFunc getClassifier()
+{
+#ifdef CHARINDEX_AVX2
+    if (cpuHasAvx2())
+    {
+        return classifyAvx2;
+    }
+#endif
+#ifdef CHARINDEX_SSE2
+    return classifySse2;
+#else
+    return classifyScalar;
+#endif
+}
+
+static size_t jsonPlainLenScalar(const char* s, size_t len, size_t i)
+{
+    for (; i < len; i++)
+    {
+        uchar c = (uchar)s[i];
+        if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\')
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+#ifdef CHARINDEX_SSE2
+
+static size_t jsonPlainLenSse2(const char* s, size_t len)
+{
+    // A signed compare with 0x20 catches both control chars and chars >= 0x80.
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i esc = _mm_or_si128(_mm_cmplt_epi8(x, _mm_set1_epi8(0x20)),
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))));
+
+        uint mask = (uint)_mm_movemask_epi8(esc);
+        if (mask != 0)
+        {
+            return i + ctz64(mask);
+        }
+    }
+    return jsonPlainLenScalar(s, len, i);
+}
+
+#endif
+
+#ifdef CHARINDEX_AVX2
+
+__attribute__((target("avx2")))
+static size_t jsonPlainLenAvx2(const char* s, size_t len)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(s + i));
+        __m256i esc = _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), x),
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))));
+
+        uint mask = (uint)_mm256_movemask_epi8(esc);
+        if (mask != 0)
+        {
+            return i + ctz64(mask);
+        }
+    }
+    return jsonPlainLenScalar(s, len, i);
+}
+
+#endif
+
+#ifndef CHARINDEX_SSE2
+
+static size_t jsonPlainLenPortable(const char* s, size_t len)
+{
+    return jsonPlainLenScalar(s, len, 0);
+}
+
+#endif
+
+typedef size_t (*PlainLenFunc)(const char* s, size_t len);
+
+static PlainLenFunc getPlainLen()
+{
+#ifdef CHARINDEX_AVX2
+    if (cpuHasAvx2())
+    {
+        return jsonPlainLenAvx2;
+    }
+#endif
+#ifdef CHARINDEX_SSE2
+    return jsonPlainLenSse2;
+#else
+    return jsonPlainLenPortable;
+#endif
+}
+
+size_t jsonPlainLen(const char* s, size_t len)
+{
+    static PlainLenFunc plainlen = getPlainLen();
+
+    if (len < 16)
+    {
+        // Short strings like most keys aren't worth a vector load.
+
+        return jsonPlainLenScalar(s, len, 0);
+    }
+    return plainlen(s, len);
+}
+
+void CharIndex::init(const char* txt, size_t len)
+{
+    mTxt = txt;
+    mTxtLen = len;
+    mBase = 0;
+    mEnd = 0;
+
+    // Small texts only need a small window.
+
+    size_t words = (len + 63) / 64;
+    mWindowWords = (words > (size_t)WINDOWWORDS) ? (int)WINDOWWORDS : (int)words;
+    mBits.reAlloc(MAP_COUNT * mWindowWords * sizeof(uint64_t));
+}
+
+void CharIndex::classify(size_t base)
+{
+    static ClassifyFunc classifyfull = getClassifier();
+
+    uint64_t* bits = (uint64_t*)mBits.ptr();
+
+    mBase = base;
+    mEnd = base + mWindowWords * 64;
+    if (mEnd > mTxtLen)
+    {
+        mEnd = mTxtLen;
+    }
+
+    // Full blocks use the fastest classifier available, the tail is done one char
+    // at a time so nothing is read past the end of the text.
+
+    int w = 0;
+    for (size_t pos = mBase; pos < mEnd; pos += 64, w++)
+    {
+        if (mEnd - pos >= 64)
+        {
+            classifyfull(mTxt + pos, 64, bits, mWindowWords, w);
+        }
+        else
+        {
+            classifyScalar(mTxt + pos, (int)(mEnd - pos), bits, mWindowWords, w);
+        }
+    }
+}
+
+size_t CharIndex::scan(int map, bool set, size_t pos, int* newlines)
+{
+    while (pos < mTxtLen)
+    {
+        if (pos < mBase || pos >= mEnd)
+        {
+            classify(pos & ~(size_t)63);
+        }
+
+        const uint64_t* bits = (const uint64_t*)mBits.cptr();
+        int ofs = (int)(pos - mBase);
+        int w = ofs >> 6;
+        uint64_t from = ~(uint64_t)0 << (ofs & 63);
+
+        uint64_t word = bits[map * mWindowWords + w];
+        if (!set)
+        {
+            word = ~word;
+        }
+        word &= from;
+
+        // Either the match is in this word or continue with the next word.
+
+        size_t found = mBase + (w << 6) + (word != 0 ? ctz64(word) : 64);
+        if (found > mTxtLen)
+        {
+            found = mTxtLen;
+        }
+
+        if (newlines)
+        {
+            int upto = (int)(found - (mBase + (w << 6)));
+            uint64_t below = (upto >= 64) ? ~(uint64_t)0 : (((uint64_t)1 << upto) - 1);
+
+            *newlines += popcount64(bits[MAP_NEWLINE * mWindowWords + w] & from & below);
+        }
+
+        if (word != 0)
+        {
+            return found;
+        }
+        pos = found;
+    }
+    return mTxtLen;
+}
+
+
 // Parser::
 
 Parser::Parser(const char* txt) :
@@ -431,7 +1342,11 @@ Parser::Parser(const char* txt) :
     mErr(false),
     mTokStartPos(0),
     mTokEndPos(0),
-    mSinglePunc(false)
+    mSinglePunc(false),
+    mInsitu(false),
+    mInsituStr(NULL),
+    mInsituLen(0),
+    mIndexed(false)
 {
     if (txt)
     {
@@ -443,6 +1358,29 @@ Parser::Parser(const char* txt) :
     }
 }
 
+Parser::Parser(const char* txt, size_t len) :
+    mTxt(txt),
+    mToken(128),
+    mTokParsed(false),
+    mPos(0),
+    mLineNum(1),
+    mErr(false),
+    mTxtLen(len),
+    mTokStartPos(0),
+    mTokEndPos(0),
+    mSinglePunc(false),
+    mInsitu(false),
+    mInsituStr(NULL),
+    mInsituLen(0),
+    mIndexed(false)
+{
+    if (!txt)
+    {
+        mTxtLen = 0;
+        setError("NULL string");
+    }
+}
+
 
 void Parser::internalParse()
 {
@@ -452,6 +1390,7 @@ void Parser::internalParse()
     char quotec = '\0';
 
     mToken.clear();
+    mInsituStr = NULL;
     while (!eof())
     {
         char c = mTxt[mPos];
@@ -464,6 +1403,12 @@ void Parser::internalParse()
             {
                 done = true;
             }
+            else if (mIndexed)
+            {
+                // Jump to the last char of the whitespace run.
+
+                mPos = mIndex.skipSpace(mPos, mLineNum) - 1;
+            }
             else if (c == '\n')
             {
                 mLineNum++;
@@ -477,12 +1422,18 @@ void Parser::internalParse()
             if (state == NullTok)
             {
                 state = detState(c);
+                mTokStartPos = mPos;
+
                 if (state == QuoteTok)
                 {
                     quotec = c;
-                }
 
-                mTokStartPos = mPos;
+                    if (mInsitu)
+                    {
+                        parseQuoteInsitu(quotec);
+                        break;
+                    }
+                }
 
                 append(c);
             }
@@ -510,26 +1461,17 @@ void Parser::internalParse()
                                 eraseLast();
                                 if (c == 'u')
                                 {
-                                    string hex;
-                                    for (int h = 0; h < 4; h++)
-                                    {
-                                        if (!eof())
-                                        {
-                                            mPos++;
-                                            hex += mTxt[mPos];
-                                        }
-                                    }
+                                    // Read the hex chars (a surrogate pair is two escapes),
+                                    // convert to int, and the UTF8
 
-                                    // If found 4 hex chars, convert to int, and the UTF8
-                                    if (hex.length() == 4)
+                                    size_t left = mTxtLen - mPos - 1;
+                                    uint cp;
+                                    int used;
+                                    if (readEscapeHex(mTxt + mPos + 1, left, &cp, &used))
                                     {
-                                        bool valid;
-                                        uint cp = str2baseint(hex, 16, &valid);
-                                        if (valid)
-                                        {
-                                            append(makeUTF8(cp));
-                                        }
+                                        append(makeUTF8(cp));
                                     }
+                                    mPos += ((size_t)used < left) ? used : left;
                                 }
                                 else
                                 {
@@ -543,7 +1485,18 @@ void Parser::internalParse()
                         {
                             if (c != quotec)
                             {
-                                append(c);
+                                if (mIndexed && c != '\\')
+                                {
+                                    // Copy the run up to the next quote or backslash at once.
+
+                                    size_t end = mIndex.findQuote(mPos + 1);
+                                    mToken.append(mTxt + mPos, (int)(end - mPos));
+                                    mPos = end - 1;
+                                }
+                                else
+                                {
+                                    append(c);
+                                }
                             }
                             else
                             {
@@ -563,7 +1516,16 @@ void Parser::internalParse()
                     {
                         if (charWord(c))
                         {
-                            append(c);
+                            if (mIndexed)
+                            {
+                                size_t end = mIndex.skipWord(mPos + 1);
+                                mToken.append(mTxt + mPos, (int)(end - mPos));
+                                mPos = end - 1;
+                            }
+                            else
+                            {
+                                append(c);
+                            }
                         }
                         else
                         {
@@ -613,12 +1575,105 @@ void Parser::internalParse()
 }
 
 
+void Parser::parseQuoteInsitu(char quotec)
+{
+    // Unescape the quoted text starting at mPos by moving it down within the original
+    // text.  Unescaped text is never longer than the escaped text so the write position
+    // always trails the read position.  The text is null terminated where the closing
+    // quote (or an escape) used to be.  The token itself only gets the quotes.
+
+    char* txt = (char*)mTxt;
+    size_t rd = mPos + 1;
+    size_t wr = rd;
+
+    mToken.append(quotec);
+
+    while (rd < mTxtLen)
+    {
+        char c = txt[rd];
+
+        if (c == quotec)
+        {
+            mToken.append(quotec);
+
+            mInsituStr = txt + mPos + 1;
+            mInsituLen = (int)(wr - (mPos + 1));
+            txt[wr] = '\0';
+
+            mPos = rd + 1;
+            return;
+        }
+
+        if (c == '\\' && rd + 1 < mTxtLen)
+        {
+            char escch = txt[rd + 1];
+            int pos;
+
+            rd += 2;
+            if (strfind(ESCAPE_CODES, escch, &pos))
+            {
+                txt[wr++] = ESCAPE_CHARS[pos];
+            }
+            else if (escch == 'u')
+            {
+                // Read the hex chars (a surrogate pair is two escapes), convert to int, and
+                // the UTF8.  It is never longer than the escape.
+
+                uint cp;
+                int used;
+                if (readEscapeHex(txt + rd, (rd < mTxtLen) ? mTxtLen - rd : 0, &cp, &used))
+                {
+                    std::string utf = makeUTF8(cp);
+                    memcpy(txt + wr, utf.c_str(), utf.length());
+                    wr += utf.length();
+                }
+                rd += used;
+            }
+            else
+            {
+                setError("Illegal escape char");
+                break;
+            }
+        }
+        else if (mIndexed)
+        {
+            // Move the run up to the next quote or backslash at once.
+
+            size_t end = mIndex.findQuote(rd + 1);
+            if (wr != rd)
+            {
+                memmove(txt + wr, txt + rd, end - rd);
+            }
+            wr += end - rd;
+            rd = end;
+        }
+        else
+        {
+            txt[wr++] = c;
+            rd++;
+        }
+    }
+
+    // Missing the closing quote, the token is left with only the opening quote.
+
+    mPos = mTxtLen;
+}
+
+void Parser::setIndexed(bool enable)
+{
+    mIndexed = enable && !mErr;
+    if (mIndexed)
+    {
+        mIndex.init(mTxt, mTxtLen);
+    }
+}
+
 void Parser::captureDelim(const char* delim)
 {
     StrBld s(token());
 
-    int startpos = mTokStartPos;
-    int endpos = mTokEndPos;
+    size_t startpos = mTokStartPos;
+    size_t endpos = mTokEndPos;
 
     while (!eof() && !tokenEquals(delim))
     {
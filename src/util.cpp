@@ -7,6 +7,12 @@
 #include <sys/timeb.h>
 #endif
 
+#ifndef _MSC_VER
+#include <sys/mman.h>
+#include <fcntl.h>
+#define HAVE_MMAP
+#endif
+
 namespace jvar
 {
 
@@ -96,6 +102,31 @@ int random(int max)
     return rand() % max;
 }
 
+bool cpuHasAvx2()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    static int avx2 = -1;
+    if (avx2 < 0)
+    {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return avx2 == 1;
+#else
+    return false;
+#endif
+}
+
+int cpuCount()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
 std::string nowStr(const char* fmt /* = NULL */)
 {
     Date t;
@@ -226,4 +257,345 @@ bool Buffer::readFile(const char* filename, bool nullterm)
     return ret;
 }
 
+bool MappedFile::open(const char* filename, bool sequential /*= true*/)
+{
+    close();
+
+#ifdef HAVE_MMAP
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        dbgerr("Failed to open file '%s'\n", filename);
+        return false;
+    }
+
+    struct stat st;
+    bool ret = false;
+
+    if (fstat(fd, &st) == 0)
+    {
+        mSize = st.st_size;
+        if (mSize == 0)
+        {
+            // Can't map an empty file
+
+            mData = "";
+            ret = true;
+        }
+        else
+        {
+            void* p = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                if (sequential)
+                {
+                    madvise(p, mSize, MADV_SEQUENTIAL);
+                }
+                mData = (const char*)p;
+                mMapped = true;
+                ret = true;
+            }
+        }
+    }
+    ::close(fd);
+
+    if (!ret)
+    {
+        mSize = 0;
+        dbgerr("Failed to map file '%s'\n", filename);
+    }
+    return ret;
+#else
+    if (!mBuf.readFile(filename, false))
+    {
+        return false;
+    }
+    mData = (const char*)mBuf.cptr();
+    mSize = mBuf.size();
+    if (mData == NULL)
+    {
+        mData = "";
+    }
+    return true;
+#endif
+}
+
+void MappedFile::close()
+{
+#ifdef HAVE_MMAP
+    if (mMapped)
+    {
+        munmap((void*)mData, mSize);
+    }
+#endif
+    mBuf.free();
+    mData = NULL;
+    mSize = 0;
+    mMapped = false;
+}
+
+
+// Arena::
+
+#ifdef _MSC_VER
+static __declspec(thread) Arena* sCurrentArena = NULL;
+#else
+static __thread Arena* sCurrentArena = NULL;
+#endif
+
+Arena* Arena::current()
+{
+    return sCurrentArena;
+}
+
+void Arena::setCurrent(Arena* arena)
+{
+    sCurrentArena = arena;
+}
+
+void* Arena::alloc(size_t size)
+{
+    size = align(size);
+
+    Block* block = mBlocks;
+    if (block != NULL && block->used + size <= block->size)
+    {
+        void* p = blockData(block) + block->used;
+        block->used += size;
+        return p;
+    }
+
+    // Large allocations get a block of their own behind the current one, so the rest of
+    // the current block is still used.
+
+    bool own = (size > mBlockSize / 4);
+    size_t blocksize = own ? size : mBlockSize;
+
+    Block* newblock = (Block*)::malloc(sizeof(Block) + blocksize);
+    if (newblock == NULL)
+    {
+        dbgerr("Arena failed to allocate %lu bytes\n", (ulongint)blocksize);
+        return NULL;
+    }
+    newblock->size = blocksize;
+    newblock->used = size;
+    mSize += blocksize;
+
+    if (own && block != NULL)
+    {
+        newblock->next = block->next;
+        block->next = newblock;
+    }
+    else
+    {
+        newblock->next = block;
+        mBlocks = newblock;
+    }
+    return blockData(newblock);
+}
+
+void* Arena::reAlloc(void* ptr, size_t oldsize, size_t newsize)
+{
+    if (ptr != NULL)
+    {
+        Block* block = mBlocks;
+        char* top = blockData(block) + block->used;
+
+        if (newsize <= oldsize)
+        {
+            return ptr;
+        }
+        if ((char*)ptr + align(oldsize) == top &&
+            block->used - align(oldsize) + align(newsize) <= block->size)
+        {
+            // Last allocation, grow it in place
+
+            block->used += align(newsize) - align(oldsize);
+            return ptr;
+        }
+    }
+
+    void* p = alloc(newsize);
+    if (p != NULL && ptr != NULL)
+    {
+        memcpy(p, ptr, oldsize);
+    }
+    return p;
+}
+
+bool Arena::addCleanup(void (*fn)(void*), void* obj)
+{
+    Cleanup* cleanup = (Cleanup*)alloc(sizeof(Cleanup));
+    if (cleanup == NULL)
+    {
+        return false;
+    }
+    cleanup->next = mCleanups;
+    cleanup->fn = fn;
+    cleanup->obj = obj;
+    mCleanups = cleanup;
+    return true;
+}
+
+void Arena::free()
+{
+    // The cleanups are in the blocks, so they run first.
+
+    for (Cleanup* cleanup = mCleanups; cleanup != NULL; cleanup = cleanup->next)
+    {
+        cleanup->fn(cleanup->obj);
+    }
+    mCleanups = NULL;
+
+    Block* block = mBlocks;
+    while (block != NULL)
+    {
+        Block* next = block->next;
+        ::free(block);
+        block = next;
+    }
+    mBlocks = NULL;
+    mSize = 0;
+}
+
+
+// WorkerPool::
+
+WorkerPool::WorkerPool(int numthreads /*= 0*/) :
+    mNumWorkers(0),
+    mFunc(NULL),
+    mCtx(NULL),
+    mCount(0),
+    mNext(0),
+    mPending(0),
+    mQuit(false)
+{
+#ifndef _MSC_VER
+    if (numthreads <= 0)
+    {
+        numthreads = cpuCount();
+    }
+
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mWake, NULL);
+    pthread_cond_init(&mDone, NULL);
+
+    // The caller of run() is one of the threads.
+
+    mThreads = new pthread_t[numthreads];
+    for (int i = 0; i < numthreads - 1; i++)
+    {
+        if (pthread_create(&mThreads[mNumWorkers], NULL, workerMain, this) != 0)
+        {
+            dbgerr("Failed to create worker thread\n");
+            break;
+        }
+        mNumWorkers++;
+    }
+#endif
+}
+
+WorkerPool::~WorkerPool()
+{
+#ifndef _MSC_VER
+    pthread_mutex_lock(&mLock);
+    mQuit = true;
+    pthread_cond_broadcast(&mWake);
+    pthread_mutex_unlock(&mLock);
+
+    for (int i = 0; i < mNumWorkers; i++)
+    {
+        pthread_join(mThreads[i], NULL);
+    }
+    delete[] mThreads;
+
+    pthread_cond_destroy(&mDone);
+    pthread_cond_destroy(&mWake);
+    pthread_mutex_destroy(&mLock);
+#endif
+}
+
+void WorkerPool::run(TaskFunc func, void* ctx, int count)
+{
+#ifndef _MSC_VER
+    if (mNumWorkers > 0 && count > 1)
+    {
+        pthread_mutex_lock(&mLock);
+        mFunc = func;
+        mCtx = ctx;
+        mCount = count;
+        mNext = 0;
+        mPending = count;
+        pthread_cond_broadcast(&mWake);
+
+        // Help out, then wait for the tasks still running on the workers.
+
+        while (mNext < mCount)
+        {
+            int index = mNext++;
+
+            pthread_mutex_unlock(&mLock);
+            func(ctx, index);
+            pthread_mutex_lock(&mLock);
+
+            mPending--;
+        }
+        while (mPending > 0)
+        {
+            pthread_cond_wait(&mDone, &mLock);
+        }
+
+        mCount = 0;
+        mNext = 0;
+        pthread_mutex_unlock(&mLock);
+        return;
+    }
+#endif
+
+    for (int i = 0; i < count; i++)
+    {
+        func(ctx, i);
+    }
+}
+
+#ifndef _MSC_VER
+
+void* WorkerPool::workerMain(void* arg)
+{
+    ((WorkerPool*)arg)->work();
+    return NULL;
+}
+
+void WorkerPool::work()
+{
+    pthread_mutex_lock(&mLock);
+    for (;;)
+    {
+        while (!mQuit && mNext >= mCount)
+        {
+            pthread_cond_wait(&mWake, &mLock);
+        }
+        if (mQuit)
+        {
+            break;
+        }
+
+        int index = mNext++;
+        TaskFunc func = mFunc;
+        void* ctx = mCtx;
+
+        pthread_mutex_unlock(&mLock);
+        func(ctx, index);
+        pthread_mutex_lock(&mLock);
+
+        if (--mPending == 0)
+        {
+            pthread_cond_signal(&mDone);
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+#endif
+
 } // jvar
@@ -3,6 +3,9 @@
 
 #include "var.h"
 #include "json.h"
+#include "msgpack.h"
+#include "cbor.h"
+#include "snapshot.h"
 
 #if __cplusplus > 199711L
 #include <initializer_list>
@@ -17,6 +20,86 @@ Variant Variant::sEmpty;
 Variant Variant::sNull(Variant::V_NULL);
 RcLife<BaseInterface> Variant::sNullExtIntf;
 
+/**
+ * Arrays and objects of Variants are allocated with a reference count, so copies can
+ * share them (see Variant::enableCopyOnWrite()).  Without VF_COW the count stays 1.
+ */
+template <class T>
+class Shared : public T
+{
+public:
+    Shared() :
+        mRefs(1)
+    {
+    }
+    Shared(Arena& arena) :
+        T(arena),
+        mRefs(1)
+    {
+    }
+    Shared(const T& src) :
+        T(src),
+        mRefs(1)
+    {
+    }
+    Shared(const T& src, Arena& arena) :
+        T(src, arena),
+        mRefs(1)
+    {
+    }
+    Shared(const Shared& src) :
+        T(src),
+        mRefs(1)
+    {
+    }
+
+    volatile int mRefs;
+};
+typedef Shared< ObjArray<Variant> > SharedArray;
+typedef Shared< PropArray<Variant> > SharedObject;
+
+static inline SharedArray* sharedArray(ObjArray<Variant>* arr)
+{
+    return static_cast<SharedArray*>(arr);
+}
+
+static inline SharedObject* sharedObject(PropArray<Variant>* obj)
+{
+    return static_cast<SharedObject*>(obj);
+}
+
+/**
+ * Makes a new array or object (or a copy of \p src) in the current arena if there is one,
+ * otherwise on the heap.  Returns true if it's in the arena.
+ */
+template <class S, class T>
+static bool newShared(T*& data)
+{
+    Arena* arena = Arena::current();
+    void* mem = (arena != NULL) ? arena->alloc(sizeof(S)) : NULL;
+    if (mem != NULL)
+    {
+        data = new (mem) S(*arena);
+        return true;
+    }
+    data = new S();
+    return false;
+}
+
+template <class S, class T>
+static bool newShared(T*& data, const T& src)
+{
+    Arena* arena = Arena::current();
+    void* mem = (arena != NULL) ? arena->alloc(sizeof(S)) : NULL;
+    if (mem != NULL)
+    {
+        data = new (mem) S(src, *arena);
+        return true;
+    }
+    data = new S(src);
+    return false;
+}
+
 const KeywordArray::Entry Variant::sTypeNames[] =
 {
     {"empty", Variant::V_EMPTY},
@@ -48,8 +131,28 @@ bool Variant::parseJson(const char* jsontxt)
     return !err;
 }
 
+bool Variant::reparseJson(const char* jsontxt)
+{
+    if (mData.type == V_NULL)
+    {
+        return false;
+    }
+    JsonParser json(*this, jsontxt, JsonParser::FLAG_REUSE);
+    bool err = json.failed();
+    if (err)
+    {
+        clear();
+    }
+    setModified();
+    return !err;
+}
+
 bool Variant::eq(const char* s)
 {
+    if (mData.type == V_STRING)
+    {
+        return equal(mData.strPtr(), s);
+    }
     return equal(toString().c_str(), s);
 }
 
@@ -93,10 +196,9 @@ longint Variant::makeInt() const
 
         case V_STRING:
         {
-            std::string* strdata = mData.strData();
             char* end;
             errno = 0;
-            long int value = strtol(strdata->c_str(), &end, 10);
+            long int value = strtol(mData.strPtr(), &end, 10);
             if ((errno != 0 && value == 0) || (*end != '\0'))
             {
                 value = 0;
@@ -137,9 +239,8 @@ double Variant::makeDbl() const
 
         case V_STRING:
         {
-            std::string* strdata = mData.strData();
             char* end;
-            double value = strtod(strdata->c_str(), &end);
+            double value = strtod(mData.strPtr(), &end);
             if (*end != '\0')
             {
                 value = 0.0;
@@ -165,44 +266,45 @@ double Variant::makeDbl() const
 }
 
 
-void Variant::makeString(StrBld& s, int level, bool json)
+void Variant::makeString(StrBld& s, int level, bool json, int indent /* = JSON_TABS */,
+    JsonWriter* out /* = NULL */)
 {
+    // Everything is appended to s, children write into the same buffer.
+
+    ensureLoaded();
+
     switch (mData.type)
     {
         case V_STRING:
         {
-            s.clear();
-            s.append( *(mData.strData()) );
+            const char* str = mData.strPtr();
+            size_t len = mData.strLen();
 
             if (json)
             {
-                jsonifyStr(s);
+                appendJsonStr(s, str, len);
+            }
+            else
+            {
+                s.append(str, (int)len);
             }
         }
         break;
 
         case V_INT:
         {
-            s.clear();
-            s.appendFmt("%ld", mData.intData);
+            s.appendInt(mData.intData);
         }
         break;
 
         case V_DOUBLE:
         {
-            //TODO: Verify it is ok not to do the following
-            // if (tmp.find_first_of('.') == std::string::npos)
-            // {
-            //     tmp += ".0";
-            // }
-            s.clear();
-            s.appendFmt("%lg", mData.dblData);
+            s.appendDbl(mData.dblData);
         }
         break;
 
         case V_BOOL:
         {
-            s.clear();
             s.append(mData.boolData ? "true" : "false");
         }
         break;
@@ -210,14 +312,12 @@ void Variant::makeString(StrBld& s, int level, bool json)
         case V_EMPTY:
         {
             //TODO: Revisit this value--should work for json
-            s.clear();
             s.append("null");
         }
         break;
 
         case V_NULL:
         {
-            s.clear();
             s.append("null");
         }
         break;
@@ -226,26 +326,17 @@ void Variant::makeString(StrBld& s, int level, bool json)
         {
             s.append('[');
             level++;
-            for (Iter<Variant> i; forEach(i); )
+            for (Iter<Variant> i; mData.arrayData->forEach(i); )
             {
-                if (i.pos() != 0)
+                i->makeElement(s, i.pos(), NULL, level, json, indent, out);
+
+                if (out != NULL)
                 {
-                    s.append(',');
+                    out->checkFlush();
                 }
-
-                appendNewline(s, level, json);
-
-                appendQuote(s, i->type());
-
-                StrBld tmps;
-                i->makeString(tmps, level, json);
-
-                s.append(tmps);
-                appendQuote(s, i->type());
-
             }
             level--;
-            appendNewline(s, level, json);
+            appendNewline(s, level, json, indent);
             s.append(']');
         }
         break;
@@ -257,48 +348,21 @@ void Variant::makeString(StrBld& s, int level, bool json)
             level++;
             for (Iter<Variant> i; mData.objectData->forEach(i); )
             {
+                i->makeElement(s, i.pos(), i.key(), level, json, indent, out);
 
-                if (i.pos() != 0)
-                {
-                    s.append(",");
-                }
-
-                appendNewline(s, level, json);
-
-                appendQuote(s, V_STRING);
-
-                if (json)
-                {
-                    StrBld keys(i.key());
-                    jsonifyStr(keys);
-                    s.append(keys);
-                }
-                else
+                if (out != NULL)
                 {
-                    s.append(i.key());
+                    out->checkFlush();
                 }
-                appendQuote(s, V_STRING);
-
-                s.append(':');
-
-                appendQuote(s, i->type());
-
-                StrBld tmps;
-                i->makeString(tmps, level, json);
-
-                s.append(tmps);
-                appendQuote(s, i->type());
-
             }
             level--;
-            appendNewline(s, level, json);
+            appendNewline(s, level, json, indent);
             s.append('}');
         }
         break;
 
         case V_FUNCTION:
         {
-            s.clear();
             s.append("(function)");
         }
         break;
@@ -307,81 +371,235 @@ void Variant::makeString(StrBld& s, int level, bool json)
         {
             if (mData.vptrData != NULL)
             {
-                mData.vptrData->makeString(s, level, json);
+                mData.vptrData->makeString(s, level, json, indent, out);
             }
         }
+        break;
 
         default:
         {
             dbgerr("TODO: makeString not handled for type %d\n", mData.type);
         }
     }
+}
+
+void Variant::makeElement(StrBld& s, int pos, const char* key, int level, bool json, int indent,
+    JsonWriter* out)
+{
+    if (pos != 0)
+    {
+        s.append(',');
+    }
+
+    appendNewline(s, level, json, indent);
+
+    if (key != NULL)
+    {
+        appendQuote(s, V_STRING);
+
+        if (json)
+        {
+            appendJsonStr(s, key, strlen(key));
+        }
+        else
+        {
+            s.append(key);
+        }
+        appendQuote(s, V_STRING);
+
+        s.append(':');
+    }
 
-    level--;
+    appendQuote(s, type());
+    makeString(s, level, json, indent, out);
+    appendQuote(s, type());
 }
 
+// Parallel json: containers shorter than PARALLEL_MINLEN are serialized on one thread.
+// Each task gets a range of PARALLEL_MINRANGE to PARALLEL_MAXRANGE elements.
+
+enum
+{
+    PARALLEL_MINLEN = 1024,
+    PARALLEL_MINRANGE = 16,
+    PARALLEL_MAXRANGE = 4096,
+    PARALLEL_TASKSPERTHREAD = 4
+};
+
+/**
+ * Elements of a container split into ranges for makeJsonParallel()
+ */
+struct JsonRanges
+{
+    Variant* container;
+    int len;
+    int start;      // First element of the current round
+    int rangeLen;
+    int indent;
+    StrBld* bufs;   // Output of each task in the round
+};
 
-void Variant::jsonifyStr(StrBld& s)
+void Variant::jsonRangeTask(void* ctx, int index)
 {
-    StrBld ts(s.length());
+    JsonRanges& r = *(JsonRanges*)ctx;
+    VarData& data = r.container->mData;
 
-    // First check if the string needs any esc chars
+    StrBld& s = r.bufs[index];
+    s.clear();
 
-    bool escneeded = false;
-    const char* p = s.c_str();
-    for (int i = 0; i < (int)s.length(); i++)
+    int first = r.start + index * r.rangeLen;
+    int last = (first + r.rangeLen < r.len) ? first + r.rangeLen : r.len;
+
+    for (int i = first; i < last; i++)
     {
-        uint c = (unsigned char)p[i];
-        if (c >= 0x80 || (c != '/' && strfind(ESCAPE_CHARS, c, NULL)))
+        if (data.type == V_ARRAY)
         {
-            escneeded = true;
-            break;
+            data.arrayData->get(i)->makeElement(s, i, NULL, 1, true, r.indent, NULL);
+        }
+        else
+        {
+            data.objectData->get(i)->makeElement(s, i, data.objectData->getKey(i), 1, true,
+                r.indent, NULL);
         }
     }
+}
 
-    if (!escneeded)
+void Variant::makeJsonParallel(StrBld& s, int indent, WorkerPool& pool, JsonWriter* out)
+{
+    ensureLoaded();
+
+    bool isobj = (mData.type == V_OBJECT);
+    int len = (mData.type == V_ARRAY || isobj) ? length() : 0;
+
+    if (len < PARALLEL_MINLEN || pool.threadCount() < 2)
     {
+        makeString(s, 0, true, indent, out);
         return;
     }
 
-    // Build a new string replacing with json style esc chars
+    // Elements are done in rounds of a few ranges per thread, so uneven elements even out
+    // and only one round is held in memory when writing to a JsonWriter.  The ranges are
+    // appended in order, the result is the same as makeString()'s.
+
+    int tasks = pool.threadCount() * PARALLEL_TASKSPERTHREAD;
 
-    p = s.c_str();
-    for (int i = 0; i < (int)s.length(); i++)
+    JsonRanges r;
+    r.container = this;
+    r.len = len;
+    r.indent = indent;
+    r.rangeLen = len / tasks;
+    if (r.rangeLen < PARALLEL_MINRANGE)
     {
-        uint c = (unsigned char)p[i];
+        r.rangeLen = PARALLEL_MINRANGE;
+    }
+    else if (r.rangeLen > PARALLEL_MAXRANGE)
+    {
+        r.rangeLen = PARALLEL_MAXRANGE;
+    }
+    r.bufs = new StrBld[tasks];
 
-        if (c >= 0x80)
+    s.append(isobj ? '{' : '[');
+
+    for (r.start = 0; r.start < len; r.start += tasks * r.rangeLen)
+    {
+        int count = (len - r.start + r.rangeLen - 1) / r.rangeLen;
+        if (count > tasks)
         {
-            int lused = 0;
-            c = makeUnicode(&p[i], (int)s.length() - i, &lused);
+            count = tasks;
+        }
 
-            ts.appendFmt("\\u%04X", c);
+        pool.run(jsonRangeTask, &r, count);
 
-            i += lused - 1;
+        if (out != NULL)
+        {
+            out->writeChunks(r.bufs, count);
         }
         else
         {
-            // If it is an esc char, we want to escape with a proper code.
-            // NOTE: We make an exception for / here even though spec calls for it to be escaped
+            for (int i = 0; i < count; i++)
+            {
+                s.append(r.bufs[i]);
+            }
+        }
+    }
+
+    delete[] r.bufs;
+
+    appendNewline(s, 0, true, indent);
+    s.append(isobj ? '}' : ']');
+}
+
+
+void Variant::appendIndent(StrBld& s, int level, int indent)
+{
+    if (indent < 0)
+    {
+        for (int i = 0; i < level; i++)
+        {
+            s.append('\t');
+        }
+        return;
+    }
+
+    static const char spaces[] = "                                ";
+    const int maxspaces = (int)sizeof(spaces) - 1;
+
+    for (int n = level * indent; n > 0; n -= maxspaces)
+    {
+        s.append(spaces, (n < maxspaces) ? n : maxspaces);
+    }
+}
+
+void Variant::appendJsonStr(StrBld& s, const char* str, size_t len)
+{
+    // Runs which need no escaping are found 16/32 chars at a time and appended in one go.
+
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t run = jsonPlainLen(str + i, len - i);
+        s.append(str + i, (int)run);
+        i += run;
+        if (i == len)
+        {
+            break;
+        }
+
+        uint c = (unsigned char)str[i];
+        int pos;
+
+        if (c >= 0x80)
+        {
+            int lused = 0;
+            c = makeUnicode(&str[i], (int)(len - i), &lused);
 
-            int pos;
-            if (c != '/' && strfind(ESCAPE_CHARS, c, &pos))
+            if (c > 0xFFFF)
             {
-                c = ESCAPE_CODES[pos];
-                ts.append('\\');
-                ts.append(c);
+                // Outside the BMP, written as a surrogate pair
+
+                c -= 0x10000;
+                s.appendFmt("\\u%04X\\u%04X", 0xD800 + (c >> 10), 0xDC00 + (c & 0x3FF));
             }
             else
             {
-                ts.append((char)c);
+                s.appendFmt("\\u%04X", c);
             }
+            i += lused;
         }
-    }
-
-    // Return the string
+        else if (c != 0 && strfind(ESCAPE_CHARS, c, &pos))
+        {
+            s.append('\\');
+            s.append(ESCAPE_CODES[pos]);
+            i++;
+        }
+        else
+        {
+            // Other control chars
 
-    s.moveFrom(ts);
+            s.appendFmt("\\u%04X", c);
+            i++;
+        }
+    }
 }
 
 void Variant::createArray(const char* initvalue /*= 0*/)
@@ -391,7 +609,10 @@ void Variant::createArray(const char* initvalue /*= 0*/)
         if (initvalue == NULL)
         {
             mData.type = V_ARRAY;
-            mData.arrayData = new ObjArray<Variant> ();
+            if (newShared<SharedArray>(mData.arrayData))
+            {
+                setFlag(mData.flags, arenaFlags());
+            }
         }
         else
         {
@@ -406,6 +627,9 @@ void Variant::createArray(const char* initvalue /*= 0*/)
 
 Variant* Variant::append(const Variant& elem)
 {
+    ensureLoaded();
+    unshare();
+
     if (mData.type != V_ARRAY)
     {
         return NULL;
@@ -431,15 +655,44 @@ Variant* Variant::append(const Variant& elem)
     return newelem;
 }
 
+#if __cplusplus > 199711L
+
+Variant* Variant::append(Variant&& elem)
+{
+    ensureLoaded();
+
+    if (mData.type != V_ARRAY || elem.type() == V_EMPTY)
+    {
+        return append((const Variant&)elem);
+    }
+
+    // The element could be in this array, take it out before the array grows.
+
+    Variant tmp(std::move(elem));
+    unshare();
+
+    Variant* newelem = mData.arrayData->append();
+    newelem->moveFrom(tmp);
+
+    setModified();
+
+    return newelem;
+}
+
+#endif
+
 Variant Variant::pop()
 {
+    ensureLoaded();
+    unshare();
+
     Variant ret;
 
     if (isArray())
     {
         if (mData.arrayData->length() > 0)
         {
-            ret = mData.arrayData->get(mData.arrayData->length() - 1);
+            ret.moveFrom(*mData.arrayData->get(mData.arrayData->length() - 1));
             mData.arrayData->remove(mData.arrayData->length() - 1);
         }
     }
@@ -448,18 +701,25 @@ Variant Variant::pop()
         dbgerr("Cannot pop() a non-array\n");
     }
 
-    return (ret.isEmpty() ? VNULL : ret);
+    if (ret.isEmpty())
+    {
+        return VNULL;
+    }
+    return ret;
 }
 
 Variant Variant::shift()
 {
+    ensureLoaded();
+    unshare();
+
     Variant ret;
 
     if (isArray())
     {
         if (mData.arrayData->length() > 0)
         {
-            ret = mData.arrayData->get(0);
+            ret.moveFrom(*mData.arrayData->get(0));
             mData.arrayData->remove(0);
         }
     }
@@ -468,11 +728,18 @@ Variant Variant::shift()
         dbgerr("Cannot shift() a non-array\n");
     }
 
-    return (ret.isEmpty() ? VNULL : ret);
+    if (ret.isEmpty())
+    {
+        return VNULL;
+    }
+    return ret;
 }
 
 void Variant::sort(Compare comp)
 {
+    ensureLoaded();
+    unshare();
+
     if (!isArray())
     {
         dbgerr("Cannot sort() a non-array\n");
@@ -485,14 +752,17 @@ void Variant::sort(Compare comp)
 
 int Variant::indexOf(const char* str)
 {
+    ensureLoaded();
+
     if (mData.type == V_STRING)
     {
-        size_t pos = s().find(str);
-        return (pos != std::string::npos ? (int)pos : -1);
+        const char* text = mData.strPtr();
+        const char* found = strstr(text, str);
+        return (found != NULL ? (int)(found - text) : -1);
     }
     else if (mData.type == V_ARRAY)
     {
-        for (Iter<Variant> i; forEach(i); )
+        for (Iter<Variant> i; mData.arrayData->forEach(i); )
         {
             if (i->eq(str))
             {
@@ -505,12 +775,25 @@ int Variant::indexOf(const char* str)
 
 int Variant::lastIndexOf(const char* str)
 {
+    ensureLoaded();
+
    if (mData.type != V_STRING)
    {
        return -1;
    }
-   size_t pos = s().rfind(str);
-   return (pos != std::string::npos ? (int)pos : -1);
+
+   const char* text = mData.strPtr();
+   size_t len = mData.strLen();
+   size_t strlength = strlen(str);
+
+   for (size_t pos = len - strlength + 1; strlength <= len && pos-- > 0; )
+   {
+       if (memcmp(text + pos, str, strlength) == 0)
+       {
+           return (int)pos;
+       }
+   }
+   return -1;
 }
 
 void Variant::split(const char* str, const char* sep)
@@ -532,7 +815,10 @@ void Variant::createObject(const char* initvalue /* = NULL*/)
         if (initvalue == NULL)
         {
             mData.type = V_OBJECT;
-            mData.objectData = new PropArray<Variant> ();
+            if (newShared<SharedObject>(mData.objectData))
+            {
+                setFlag(mData.flags, arenaFlags());
+            }
         }
         else
         {
@@ -553,6 +839,9 @@ void Variant::createObject(const char* initvalue /* = NULL*/)
 
 Variant& Variant::addProperty(const char* key, const Variant& value /* = VEMPTY */)
 {
+    ensureLoaded();
+    unshare();
+
     assert(key);
 
     if (mData.type != V_OBJECT)
@@ -579,9 +868,28 @@ Variant& Variant::addProperty(const char* key, const Variant& value /* = VEMPTY
     return *newprop;
 }
 
+#if __cplusplus > 199711L
+
+Variant& Variant::addProperty(const char* key, Variant&& value)
+{
+    // The value could be a property of this object, take it out before adding.
+
+    Variant tmp(std::move(value));
+
+    Variant& newprop = addProperty(key);
+    newprop.moveFrom(tmp);
+
+    return newprop;
+}
+
+#endif
+
 
 Variant& Variant::addOrModifyProperty(const char* key)
 {
+    ensureLoaded();
+    unshare();
+
     assert(key);
 
     if (mData.type != V_OBJECT)
@@ -605,6 +913,9 @@ Variant& Variant::addOrModifyProperty(const char* key)
 
 bool Variant::removeProperty(const char* key)
 {
+    ensureLoaded();
+    unshare();
+
     assert(key);
 
     if (mData.type == V_OBJECT)
@@ -621,6 +932,8 @@ bool Variant::removeProperty(const char* key)
 
 const char* Variant::getKey(int n)
 {
+    ensureLoaded();
+
     if (mData.type == V_OBJECT)
     {
         return mData.objectData->getKey(n);
@@ -630,6 +943,8 @@ const char* Variant::getKey(int n)
 
 bool Variant::hasProperty(const char* key)
 {
+    ensureLoaded();
+
     assert(key);
 
     if (mData.type == V_OBJECT)
@@ -675,6 +990,9 @@ Variant* Variant::handleMissingKey(const char* key)
 
 Variant& Variant::operator[](const char* key)
 {
+    ensureLoaded();
+    unshare();
+
     assert(key);
 
     if (mData.type == V_OBJECT)
@@ -707,6 +1025,8 @@ Variant& Variant::operator[](const char* key)
 
 const Variant& Variant::operator[](const char* key) const
 {
+    ensureLoaded();
+
     assert(key);
 
     if (mData.type == V_OBJECT)
@@ -738,6 +1058,8 @@ const Variant& Variant::operator[](const char* key) const
 
 Variant& Variant::path(const char* pathkey)
 {
+    ensureLoaded();
+
     assert(pathkey);
 
     //dbglog("path: %p ['%s']\n", this, pathkey);
@@ -784,6 +1106,8 @@ const char* Variant::typeName() const
 
 int Variant::length() const
 {
+    ensureLoaded();
+
    if (mData.type == V_ARRAY)
     {
         return mData.arrayData->length();
@@ -795,8 +1119,26 @@ int Variant::length() const
     return 1;
 }
 
+void Variant::reserve(int count)
+{
+    ensureLoaded();
+    unshare();
+
+    if (mData.type == V_ARRAY)
+    {
+        mData.arrayData->reserve(count);
+    }
+    else if (mData.type == V_OBJECT)
+    {
+        mData.objectData->reserve(count);
+    }
+}
+
 Variant& Variant::operator[](int i)
 {
+    ensureLoaded();
+    unshare();
+
     if (mData.type == V_ARRAY)
     {
         Variant* v = mData.arrayData->get(i);
@@ -822,6 +1164,8 @@ Variant& Variant::operator[](int i)
 
 const Variant& Variant::operator[](int i) const
 {
+    ensureLoaded();
+
     if (mData.type == V_ARRAY)
     {
         Variant* v = mData.arrayData->get(i);
@@ -887,27 +1231,60 @@ Variant Variant::operator() ()
     return (*this)({});
 }
 
-Variant Variant::operator() (const Variant& value1)
+Variant Variant::operator() (Variant value1)
 {
-    return (*this)({value1});
+    if (mData.type != V_FUNCTION) return VNULL;
+
+    Variant arg;
+
+    arg.createArray();
+    arg.append(std::move(value1));
+
+    return mData.funcData->mFunc(mData.funcData->mEnv, arg);
 }
 
-Variant Variant::operator() (const Variant& value1, const Variant& value2)
+Variant Variant::operator() (Variant value1, Variant value2)
 {
-    return (*this)({value1, value2});
+    if (mData.type != V_FUNCTION) return VNULL;
+
+    Variant arg;
+
+    arg.createArray();
+    arg.append(std::move(value1));
+    arg.append(std::move(value2));
+
+    return mData.funcData->mFunc(mData.funcData->mEnv, arg);
 }
 
-Variant Variant::operator() (const Variant& value1, const Variant& value2, const Variant& value3)
+Variant Variant::operator() (Variant value1, Variant value2, Variant value3)
 {
-    return (*this)({value1, value2, value3});
+    if (mData.type != V_FUNCTION) return VNULL;
+
+    Variant arg;
+
+    arg.createArray();
+    arg.append(std::move(value1));
+    arg.append(std::move(value2));
+    arg.append(std::move(value3));
+
+    return mData.funcData->mFunc(mData.funcData->mEnv, arg);
 }
 
 
-Variant Variant::operator() (const Variant& value1, const Variant& value2, const Variant& value3,
-    const Variant& value4)
+Variant Variant::operator() (Variant value1, Variant value2, Variant value3, Variant value4)
 {
-    return (*this)({value1, value2, value3, value4});
-}
+    if (mData.type != V_FUNCTION) return VNULL;
+
+    Variant arg;
+
+    arg.createArray();
+    arg.append(std::move(value1));
+    arg.append(std::move(value2));
+    arg.append(std::move(value3));
+    arg.append(std::move(value4));
+
+    return mData.funcData->mFunc(mData.funcData->mEnv, arg);
+}
 
 /*
  * Pre-C++11 code (does not require init lists)
@@ -1042,25 +1419,52 @@ bool Variant::deleteData()
     {
         case V_STRING:
         {
-            std::string* strdata = mData.strData();
-
-            // Call the string destructor on the inplace newed object.
-            using namespace std;
-	    strdata->std::string::~string();
-            //strdata->std::string::~basic_string();
+            mData.deleteStr();
         }
         break;
 
         case V_ARRAY:
         {
-            delete mData.arrayData;
+            if (isFlagSet(mData.flags, VF_LAZY))
+            {
+                // Never parsed, nothing allocated.
+
+                clearFlag(mData.flags, VF_LAZY | VF_LAZYFLEX);
+                break;
+            }
+            SharedArray* arr = sharedArray(mData.arrayData);
+            if (isFlagSet(mData.flags, VF_ARENA))
+            {
+                // The memory is given back with the arena
+
+                arr->~SharedArray();
+            }
+            else if (isFlagClear(mData.flags, VF_COW) || atomicAdd(&arr->mRefs, -1) == 0)
+            {
+                delete arr;
+            }
+            clearFlag(mData.flags, VF_COW | VF_ARENA | VF_ARENAMOD | VF_DOCREF);
             mData.arrayData = NULL;
         }
         break;
 
         case V_OBJECT:
         {
-            delete mData.objectData;
+            if (isFlagSet(mData.flags, VF_LAZY))
+            {
+                clearFlag(mData.flags, VF_LAZY | VF_LAZYFLEX);
+                break;
+            }
+            SharedObject* obj = sharedObject(mData.objectData);
+            if (isFlagSet(mData.flags, VF_ARENA))
+            {
+                obj->~SharedObject();
+            }
+            else if (isFlagClear(mData.flags, VF_COW) || atomicAdd(&obj->mRefs, -1) == 0)
+            {
+                delete obj;
+            }
+            clearFlag(mData.flags, VF_COW | VF_ARENA | VF_ARENAMOD | VF_DOCREF);
             mData.objectData = NULL;
         }
         break;
@@ -1080,6 +1484,8 @@ bool Variant::deleteData()
 
 void Variant::copyFrom(const Variant* src)
 {
+    src->ensureLoaded();
+
     if (this != src)
     {
         if (!deleteData())
@@ -1114,26 +1520,60 @@ void Variant::copyFrom(const Variant* src)
             {
                 //TODO: Should not deleteData() above and new here if already string type
 
-                // Inplace new a std::string object with the source string passed to
-                // the constructor.
+                if (isFlagSet(src->mData.flags, VF_STRBUF) && isFlagClear(src->mData.flags, VF_ARENA))
+                {
+                    // Share the text, it isn't changed while shared.
+
+                    mData.strBufData = src->mData.strBufData;
+                    (void)atomicAdd(&mData.strBufData->refs, 1);
+                    setFlag(mData.flags, VF_STRBUF);
+                    break;
+                }
+
+                // A referenced or std::string string becomes inline or a StrBuf in the
+                // copy.
 
-                new (&mData.strMemData) std::string(*(src->mData.strData()));
+                mData.newStr(src->mData.strPtr(), src->mData.strLen());
             }
             break;
 
             case V_ARRAY:
             {
+                if (isFlagSet(src->mData.flags, VF_COW) && isFlagClear(src->mData.flags, VF_ARENA | VF_DOCREF))
+                {
+                    // Share the array until one side changes it (see unshare()).
+
+                    mData.arrayData = src->mData.arrayData;
+                    (void)atomicAdd(&sharedArray(mData.arrayData)->mRefs, 1);
+                    setFlag(mData.flags, VF_COW);
+                    break;
+                }
+
                 // Create the array object using the copy constructor.
 
-                mData.arrayData = new ObjArray<Variant>(*(src->mData.arrayData));
+                if (newShared<SharedArray>(mData.arrayData, *(src->mData.arrayData)))
+                {
+                    setFlag(mData.flags, arenaFlags());
+                }
             }
             break;
 
             case V_OBJECT:
             {
+                if (isFlagSet(src->mData.flags, VF_COW) && isFlagClear(src->mData.flags, VF_ARENA | VF_DOCREF))
+                {
+                    mData.objectData = src->mData.objectData;
+                    (void)atomicAdd(&sharedObject(mData.objectData)->mRefs, 1);
+                    setFlag(mData.flags, VF_COW);
+                    break;
+                }
+
                 // Create the proparray object using the copy constructor.
 
-                mData.objectData = new PropArray<Variant>(*(src->mData.objectData));
+                if (newShared<SharedObject>(mData.objectData, *(src->mData.objectData)))
+                {
+                    setFlag(mData.flags, arenaFlags());
+                }
             }
             break;
 
@@ -1173,11 +1613,232 @@ void Variant::copyFrom(const Variant* src)
     }
 }
 
+void Variant::moveFrom(Variant& src)
+{
+    if (this == &src || mData.type == V_NULL)
+    {
+        return;
+    }
+
+    // VNULL is shared and must stay null, empty and null are copied.  So are values in an
+    // arena or referencing text, and arrays or objects parsed in place or lazily whose
+    // elements may reference text, the memory belongs to a document.
+
+    if (src.mData.type == V_NULL || src.mData.type == V_EMPTY ||
+        isFlagSet(src.mData.flags, VF_ARENA | VF_STRREF | VF_LAZY | VF_DOCREF))
+    {
+        copyFrom(&src);
+        return;
+    }
+
+    // src could be inside this variant (v = std::move(v["a"])), so take its data out
+    // before deleting ours.
+
+    Variant tmp;
+    tmp.takeData(src);
+
+    (void)deleteData();
+    takeData(tmp);
+
+    setModified();
+}
+
+void Variant::takeData(Variant& src)
+{
+    const shortint dataflags = VF_STRREF | VF_STRINLINE | VF_STRBUF | VF_LAZY | VF_LAZYFLEX | VF_COW |
+        VF_ARENA | VF_ARENAMOD | VF_DOCREF;
+
+    // Pointers, scalars, inline, referenced and lazy text are in VarData and just copied.
+    // An inplace std::string is swapped into a new (empty) one, which doesn't allocate.
+
+    shortint flags = mData.flags;
+    mData = src.mData;
+    mData.flags = (flags & ~dataflags) | (src.mData.flags & dataflags);
+
+    if (VarData::STRINPLACE && src.mData.type == V_STRING && src.mData.strIsStd() &&
+        isFlagClear(src.mData.flags, VF_ARENA))
+    {
+        mData.newStdStr("");
+        mData.strData()->swap(*src.mData.strData());
+        (void)src.deleteData();
+    }
+    else
+    {
+        // The data belongs to this variant now, so src is emptied without freeing it.
+
+        src.mData.type = V_EMPTY;
+        clearFlag(src.mData.flags, dataflags);
+    }
+}
+
+void Variant::VarData::newStr(const char* src, size_t len)
+{
+    if (len <= INLINEMAX)
+    {
+        char* text = strInline();
+        memmove(text, src, len);
+        text[len] = '\0';
+        text[INLINEMAX] = (char)(INLINEMAX - len);
+        setFlag(flags, VF_STRINLINE);
+        return;
+    }
+
+    Arena* arena = Arena::current();
+    StrBuf* buf;
+    if (arena != NULL)
+    {
+        buf = (StrBuf*)arena->alloc(sizeof(StrBuf) + len + 1);
+        setFlag(flags, VF_ARENA);
+    }
+    else
+    {
+        buf = (StrBuf*)malloc(sizeof(StrBuf) + len + 1);
+    }
+    if (buf == NULL)
+    {
+        clearFlag(flags, VF_ARENA);
+        dbgerr("Failed to allocate string of %d chars\n", (int)len);
+        newStr("", 0);
+        return;
+    }
+    buf->refs = 1;
+    buf->len = (uint)len;
+    buf->cap = (uint)len;
+    memcpy(buf->text(), src, len);
+    buf->text()[len] = '\0';
+
+    strBufData = buf;
+    setFlag(flags, VF_STRBUF);
+}
+
+void Variant::VarData::assignStr(const char* src, size_t len)
+{
+    if (strIsStd())
+    {
+        strData()->assign(src, len);
+        return;
+    }
+
+    if (isFlagSet(flags, VF_STRBUF) && len <= strBufData->cap && atomicGet(&strBufData->refs) == 1)
+    {
+        // Only this variant uses the text.  src may point into it.
+
+        memmove(strBufData->text(), src, len);
+        strBufData->text()[len] = '\0';
+        strBufData->len = (uint)len;
+        return;
+    }
+
+    deleteStr();
+    newStr(src, len);
+}
+
+void Variant::VarData::deleteStr()
+{
+    if (isFlagSet(flags, VF_STRBUF))
+    {
+        // Memory in an arena is given back with the arena
+
+        if (isFlagClear(flags, VF_ARENA) && atomicAdd(&strBufData->refs, -1) == 0)
+        {
+            free(strBufData);
+        }
+    }
+    else if (strIsStd() && isFlagClear(flags, VF_ARENA))
+    {
+        typedef std::string StrType;
+
+        if (STRINPLACE)
+        {
+            strData()->~StrType();
+        }
+        else
+        {
+            delete strObjData;
+        }
+    }
+
+    // Referenced text is owned elsewhere and inline text needs nothing.
+
+    clearFlag(flags, VF_STRREF | VF_STRINLINE | VF_STRBUF | VF_ARENA);
+}
+
+shortint Variant::arenaFlags()
+{
+    Arena* arena = Arena::current();
+    return (arena != NULL && arena->building()) ? VF_ARENA : (VF_ARENA | VF_ARENAMOD);
+}
+
+void Variant::detach()
+{
+    if (isFlagSet(mData.flags, VF_ARENA))
+    {
+        if (mData.type == V_ARRAY || mData.type == V_OBJECT)
+        {
+            setFlag(mData.flags, arenaFlags());
+        }
+        return;
+    }
+
+    // Copy the array or object if other copies use it too.  Its elements are copied
+    // with VF_COW as well, so they are shared until changed.
+
+    if (mData.type == V_ARRAY)
+    {
+        SharedArray* arr = sharedArray(mData.arrayData);
+        if (atomicGet(&arr->mRefs) > 1)
+        {
+            if (newShared<SharedArray>(mData.arrayData, (ObjArray<Variant>&)*arr))
+            {
+                setFlag(mData.flags, arenaFlags());
+            }
+
+            // The other copies may have let go of it meanwhile
+
+            if (atomicAdd(&arr->mRefs, -1) == 0)
+            {
+                delete arr;
+            }
+        }
+    }
+    else if (mData.type == V_OBJECT)
+    {
+        SharedObject* obj = sharedObject(mData.objectData);
+        if (atomicGet(&obj->mRefs) > 1)
+        {
+            if (newShared<SharedObject>(mData.objectData, (PropArray<Variant>&)*obj))
+            {
+                setFlag(mData.flags, arenaFlags());
+            }
+
+            if (atomicAdd(&obj->mRefs, -1) == 0)
+            {
+                delete obj;
+            }
+        }
+    }
+}
+
+void Variant::enableCopyOnWrite()
+{
+    ensureLoaded();
+
+    if (mData.type == V_ARRAY || mData.type == V_OBJECT)
+    {
+        setFlag(mData.flags, VF_COW);
+
+        for (Iter<Variant> i; forEach(i); )
+        {
+            i->enableCopyOnWrite();
+        }
+    }
+}
+
 void Variant::assignStr(const char* src)
 {
     if (mData.type == V_STRING)
     {
-        mData.strData()->assign(src);
+        mData.assignStr(src, strlen(src));
         setModified();
     }
     else
@@ -1186,10 +1847,7 @@ void Variant::assignStr(const char* src)
         {
             mData.type = V_STRING;
 
-            // Inplace new a std::string object with the source string passed to
-            // the constructor.
-
-            new (&mData.strMemData) std::string(src);
+            mData.newStr(src);
 
             setModified();
         }
@@ -1200,7 +1858,7 @@ void Variant::assignStr(const std::string& src)
 {
     if (mData.type == V_STRING)
     {
-        mData.strData()->assign(src);
+        mData.assignStr(src.data(), src.length());
         setModified();
     }
     else
@@ -1209,10 +1867,7 @@ void Variant::assignStr(const std::string& src)
         {
             mData.type = V_STRING;
 
-            // Inplace new a std::string object with the source string passed to
-            // the constructor.
-
-            new (&mData.strMemData) std::string(src);
+            mData.newStr(src);
 
             setModified();
         }
@@ -1311,18 +1966,45 @@ void Variant::assignObj(std::initializer_list<const Variant>& src)
 
 #endif
 
+static void destroyStr(void* str)
+{
+    typedef std::string StrType;
+    ((StrType*)str)->~StrType();
+}
+
 std::string& Variant::s()
 {
     if (mData.type != V_STRING)
     {
         // Note: This fails if the current var is VNULL
 
-        std::string s;
         StrBld sb;
         makeString(sb, 0, false);
         *this = sb.toString();
         setModified();
     }
+
+    if (mData.type == V_STRING && !mData.strIsStd())
+    {
+        // Make a std::string so it can be returned (and modified).
+
+        std::string str(mData.strPtr(), mData.strLen());
+        mData.deleteStr();
+
+        // In an arena the std::string is destroyed by the arena (see ArenaDoc::clear).
+
+        Arena* arena = Arena::current();
+        void* mem = (arena != NULL) ? arena->alloc(sizeof(std::string)) : NULL;
+        if (mem != NULL && arena->addCleanup(destroyStr, mem))
+        {
+            mData.strObjData = new (mem) std::string(str);
+            setFlag(mData.flags, VF_ARENA);
+        }
+        else
+        {
+            mData.newStdStr(str);
+        }
+    }
     return *(mData.strData());
 }
 
@@ -1330,7 +2012,7 @@ std::string Variant::toString() const
 {
     if (mData.type == V_STRING)
     {
-        return *(mData.strData());
+        return mData.strIsStd() ? *(mData.strData()) : std::string(mData.strPtr(), mData.strLen());
     }
     else
     {
@@ -1345,7 +2027,7 @@ std::string Variant::toStrE() const
 {
     if (mData.type == V_STRING)
     {
-        return *(mData.strData());
+        return mData.strIsStd() ? *(mData.strData()) : std::string(mData.strPtr(), mData.strLen());
     }
     else if (mData.type != V_NULL && mData.type != V_EMPTY)
     {
@@ -1357,17 +2039,72 @@ std::string Variant::toStrE() const
 }
 
 
-std::string Variant::toJsonString() const
+std::string Variant::toJsonString(int indent /* = JSON_TABS */, WorkerPool* pool /* = NULL */) const
+{
+    StrBld sb;
+    makeJson(sb, indent, pool);
+    return sb.toString();
+}
+
+void Variant::makeJson(StrBld& sb, int indent /* = JSON_TABS */, WorkerPool* pool /* = NULL */) const
+{
+    sb.clear();
+    if (pool != NULL)
+    {
+        ((Variant*)this)->makeJsonParallel(sb, indent, *pool, NULL);
+    }
+    else
+    {
+        ((Variant*)this)->makeString(sb, 0, true, indent);
+    }
+}
+
+std::string Variant::toMsgPack() const
 {
     StrBld sb;
-    ((Variant*)this)->makeString(sb, 0, true);
+    MsgPack::encode(*this, sb);
     return sb.toString();
 }
 
-void Variant::makeJson(StrBld& sb) const
+void Variant::makeMsgPack(StrBld& sb) const
 {
     sb.clear();
-    ((Variant*)this)->makeString(sb, 0, true);
+    MsgPack::encode(*this, sb);
+}
+
+bool Variant::parseMsgPack(const char* data, size_t len)
+{
+    if (mData.type == V_NULL)
+    {
+        return false;
+    }
+    bool ok = MsgPack::decode(*this, data, len);
+    setModified();
+    return ok;
+}
+
+std::string Variant::toCbor() const
+{
+    StrBld sb;
+    Cbor::encode(*this, sb);
+    return sb.toString();
+}
+
+void Variant::makeCbor(StrBld& sb) const
+{
+    sb.clear();
+    Cbor::encode(*this, sb);
+}
+
+bool Variant::parseCbor(const char* data, size_t len)
+{
+    if (mData.type == V_NULL)
+    {
+        return false;
+    }
+    bool ok = Cbor::decode(*this, data, len);
+    setModified();
+    return ok;
 }
 
 
@@ -1375,11 +2112,7 @@ std::string Variant::toFixed(int digs /*= 0*/) const
 {
     if (mData.type == V_DOUBLE)
     {
-        std::string fmt;
-        std::string s;
-        jvar::format(fmt, "%%.%df", digs);
-        jvar::format(s, fmt.c_str(), mData.dblData);
-        return s;
+        return dbl2fixed(mData.dblData, digs);
     }
     else
     {
@@ -1403,10 +2136,6 @@ void Variant::internalAdd(const Variant& lhs, const Variant& rhs)
         {
             assignDbl(lhs.mData.dblData + rhs.mData.dblData);
         }
-        else if (lhs.mData.type == V_STRING)
-        {
-            assignStr(*(lhs.mData.strData()) + *(rhs.mData.strData()));
-        }
         else
         {
             assignStr(lhs.toString() + rhs.toString());
@@ -1459,17 +2188,163 @@ void Variant::internalSetPtr(const Variant* v)
     }
 }
 
+void Variant::internalSetStrRef(const char* s)
+{
+    if (deleteData())
+    {
+        mData.type = V_STRING;
+        mData.strRefData = s;
+        setFlag(mData.flags, VF_STRREF);
+        setModified();
+    }
+}
+
+void Variant::internalSetDocRef()
+{
+    // Set by the parser on arrays and objects created in place, moving them copies the
+    // text (see moveFrom).
+
+    if (mData.type == V_ARRAY || mData.type == V_OBJECT)
+    {
+        setFlag(mData.flags, VF_DOCREF);
+    }
+}
+
+void Variant::internalSetLazy(const char* txt, bool flexquotes)
+{
+    if (!deleteData())
+    {
+        return;
+    }
+
+    mData.type = (*txt == '[') ? V_ARRAY : V_OBJECT;
+    setFlag(mData.flags, VF_LAZY);
+    if (flexquotes)
+    {
+        setFlag(mData.flags, VF_LAZYFLEX);
+    }
+    mData.lazyData = txt;
+}
+
+void Variant::internalAssignStr(const char* s, size_t len)
+{
+    // Same as assignStr() but with a length, an existing string keeps its capacity.
+
+    if (mData.type == V_STRING)
+    {
+        mData.assignStr(s, len);
+        setModified();
+    }
+    else
+    {
+        if (deleteData())
+        {
+            mData.type = V_STRING;
+            mData.newStr(s, len);
+            setModified();
+        }
+    }
+}
+
+bool Variant::internalCanReuse(Type type) const
+{
+    if (mData.type != type || isFlagSet(mData.flags, VF_LAZY))
+    {
+        return false;
+    }
+
+    // Memory shared with copies can't be reused
+
+    if (isFlagSet(mData.flags, VF_COW))
+    {
+        if (type == V_ARRAY)
+        {
+            return atomicGet(&sharedArray(mData.arrayData)->mRefs) == 1;
+        }
+        else if (type == V_OBJECT)
+        {
+            return atomicGet(&sharedObject(mData.objectData)->mRefs) == 1;
+        }
+    }
+    return true;
+}
+
+void Variant::internalTruncate(int len)
+{
+    unshare();
+
+    if (mData.type == V_ARRAY)
+    {
+        mData.arrayData->truncate(len);
+    }
+    else if (mData.type == V_OBJECT)
+    {
+        mData.objectData->truncate(len);
+    }
+}
+
+void Variant::internalRelease()
+{
+    // A value in an arena is dropped, the memory is given back with the arena and heap
+    // objects made in an Arena::Scope are destroyed by its cleanups (see ArenaDoc::clear).
+    // Only the elements of arrays and objects changed after the parse can be on the heap,
+    // the rest of the tree isn't visited.
+
+    if (isFlagSet(mData.flags, VF_ARENA))
+    {
+        if (isFlagSet(mData.flags, VF_ARENAMOD))
+        {
+            if (mData.type == V_ARRAY)
+            {
+                for (int i = 0; i < mData.arrayData->length(); i++)
+                {
+                    mData.arrayData->get(i)->internalRelease();
+                }
+            }
+            else if (mData.type == V_OBJECT)
+            {
+                for (int i = 0; i < mData.objectData->length(); i++)
+                {
+                    mData.objectData->get(i)->internalRelease();
+                }
+            }
+        }
+        clearFlag(mData.flags, VF_ARENA | VF_ARENAMOD | VF_STRBUF | VF_COW | VF_DOCREF);
+        mData.type = V_EMPTY;
+    }
+    else
+    {
+        clear();
+    }
+}
+
+void Variant::loadLazy()
+{
+    const char* txt = mData.lazyData;
+    uint flags = JsonParser::FLAG_INSITU | JsonParser::FLAG_LAZY;
+    if (isFlagSet(mData.flags, VF_LAZYFLEX))
+    {
+        flags |= JsonParser::FLAG_FLEXQUOTES;
+    }
+
+    clearFlag(mData.flags, VF_LAZY | VF_LAZYFLEX);
+    mData.type = V_EMPTY;
+
+    JsonParser::parseLazy(*this, txt, flags);
+}
 
 bool Variant::readJsonFile(const char* filename)
 {
-    Buffer jsontxt;
-    if (!jsontxt.readFile(filename, true))
+    // Parse straight from the mapped file, the parser doesn't need a null terminator.
+
+    MappedFile jsontxt;
+    if (!jsontxt.open(filename))
     {
         dbgerr("Failed to json read file: %s\n", filename);
         return false;
     }
 
-    JsonParser json(*this, (const char*)jsontxt.cptr());
+    JsonParser json(*this, jsontxt.data(), jsontxt.size(), 0);
     if (json.failed())
     {
         dbgerr("Failed to parse json file\n");
@@ -1479,8 +2354,60 @@ bool Variant::readJsonFile(const char* filename)
     return true;
 }
 
+bool Variant::writeJsonFile(const char* filename, int indent /* = JSON_TABS */,
+    WorkerPool* pool /* = NULL */) const
+{
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        dbgerr("Failed to open json file for writing: %s\n", filename);
+        return false;
+    }
+
+    bool ok;
+    {
+        JsonWriter writer(fp);
+        writer.setIndent(indent);
+        writer.setPool(pool);
+        ok = writer.write(*this) && writer.flush();
+    }
+
+    if (fclose(fp) != 0)
+    {
+        ok = false;
+    }
+    if (!ok)
+    {
+        dbgerr("Failed to write json file: %s\n", filename);
+    }
+    return ok;
+}
+
+bool Variant::writeSnapshot(const char* filename) const
+{
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        dbgerr("Failed to open snapshot file for writing: %s\n", filename);
+        return false;
+    }
+
+    bool ok = Snapshot::write(*this, fp);
+    if (fclose(fp) != 0)
+    {
+        ok = false;
+    }
+    if (!ok)
+    {
+        dbgerr("Failed to write snapshot file: %s\n", filename);
+    }
+    return ok;
+}
+
 RcLife<BaseInterface>& Variant::extInterface()
 {
+    ensureLoaded();
+
     if (mData.type == V_OBJECT)
     {
         return mData.objectData->extInterface();